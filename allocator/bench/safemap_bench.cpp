@@ -0,0 +1,304 @@
+// safemap_bench.cpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+// Microbenchmarks for the allocator's hot paths. Each safemap benchmark has a raw mmap/munmap counterpart with the
+// same arguments, so the two can be compared directly. Results can be written as JSON with
+//     safemap_bench --benchmark_out=results.json --benchmark_out_format=json
+// or by building the bench_json target.
+
+#include "mpk.h"
+#include "safemap.h"
+#include "thread_cache.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <sys/mman.h>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    constexpr int prot    = PROT_READ | PROT_WRITE;
+    constexpr int flags   = MAP_PRIVATE | MAP_ANONYMOUS;
+    constexpr size_t page = 4096;
+
+    int max_threads()
+    {
+        return static_cast<int>(std::max(1U, std::thread::hardware_concurrency()));
+    }
+
+    void* pk_map(size_t length)
+    {
+        return map_region(nullptr, length, prot, flags, -1, 0);
+    }
+
+    void pk_unmap(void* addr, size_t length)
+    {
+        unmap_region(addr, length);
+    }
+
+    void* os_map(size_t length)
+    {
+        return mmap(nullptr, length, prot, flags, -1, 0);
+    }
+
+    void os_unmap(void* addr, size_t length)
+    {
+        munmap(addr, length);
+    }
+
+    using map_fn   = void* (*)(size_t);
+    using unmap_fn = void (*)(void*, size_t);
+
+    // sizes drawn from a log-uniform distribution of 1 to 256 pages, as seen in a typical arena allocator
+    std::vector<size_t> mixed_sizes(size_t count, unsigned int seed)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<unsigned int> shift(0, 8);
+        std::vector<size_t> sizes(count);
+        for(auto& s : sizes)
+        {
+            auto pages = 1UL << shift(rng);
+            s          = page * (pages + rng() % pages);
+        }
+        return sizes;
+    }
+
+    // throughput of a map immediately followed by an unmap of the same size
+    template <map_fn map, unmap_fn unmap>
+    void BM_MapUnmap(benchmark::State& state)
+    {
+        auto length = static_cast<size_t>(state.range(0));
+        for(auto _ : state)
+        {
+            auto p = map(length);
+            benchmark::DoNotOptimize(p);
+            unmap(p, length);
+        }
+        state.SetItemsProcessed(state.iterations());
+        state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(length));
+    }
+
+    // keeps a window of live regions of mixed sizes, replacing the oldest on each iteration
+    template <map_fn map, unmap_fn unmap>
+    void BM_MapUnmapMixed(benchmark::State& state)
+    {
+        constexpr size_t live = 64;
+        auto sizes            = mixed_sizes(4096, static_cast<unsigned int>(state.thread_index()));
+        std::vector<void*> regions(live, nullptr);
+        std::vector<size_t> lengths(live, 0);
+        size_t i = 0;
+        for(auto _ : state)
+        {
+            auto slot = i % live;
+            if(regions[slot])
+            {
+                unmap(regions[slot], lengths[slot]);
+            }
+            lengths[slot] = sizes[i % sizes.size()];
+            regions[slot] = map(lengths[slot]);
+            ++i;
+        }
+        for(size_t slot = 0; slot < live; ++slot)
+        {
+            if(regions[slot])
+            {
+                unmap(regions[slot], lengths[slot]);
+            }
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    // maps and unmaps while thousands of small holes are scattered across the address space. The requests are larger
+    // than the thread cache holds, so every one of them is placed by the freelist
+    template <map_fn map, unmap_fn unmap>
+    void BM_MapUnmapFragmented(benchmark::State& state)
+    {
+        auto holes  = static_cast<size_t>(state.range(0));
+        auto length = static_cast<size_t>(state.range(1));
+        if(length <= alloc::thread_cache::max_pages * page)
+        {
+            state.SkipWithError("the thread cache would serve the requests");
+            return;
+        }
+
+        // map pairs of one and two pages, and free the single pages to leave holes too small for most requests
+        std::vector<void*> pins;
+        pins.reserve(holes);
+        for(size_t i = 0; i < holes; ++i)
+        {
+            auto hole = map(page);
+            pins.push_back(map(2 * page));
+            unmap(hole, page);
+        }
+
+        // the unmapped pages sit in this thread's cache until they are handed back to the freelist as holes
+        drain_thread_caches();
+
+        for(auto _ : state)
+        {
+            auto p = map(length);
+            benchmark::DoNotOptimize(p);
+            unmap(p, length);
+        }
+
+        for(auto p : pins)
+        {
+            unmap(p, 2 * page);
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    // latency percentiles of individual map and unmap calls
+    template <map_fn map, unmap_fn unmap>
+    void BM_MapLatency(benchmark::State& state)
+    {
+        using clock = std::chrono::steady_clock;
+        auto length = static_cast<size_t>(state.range(0));
+        std::vector<double> map_ns;
+        std::vector<double> unmap_ns;
+        map_ns.reserve(state.max_iterations);
+        unmap_ns.reserve(state.max_iterations);
+
+        for(auto _ : state)
+        {
+            auto start = clock::now();
+            auto p     = map(length);
+            auto mid   = clock::now();
+            unmap(p, length);
+            auto end = clock::now();
+            map_ns.push_back(std::chrono::duration<double, std::nano>(mid - start).count());
+            unmap_ns.push_back(std::chrono::duration<double, std::nano>(end - mid).count());
+        }
+
+        auto percentile = [](std::vector<double>& samples, double q) {
+            if(samples.empty())
+            {
+                return 0.0;
+            }
+            auto nth = samples.begin() + static_cast<ptrdiff_t>(q * static_cast<double>(samples.size() - 1));
+            std::nth_element(samples.begin(), nth, samples.end());
+            return *nth;
+        };
+        state.counters["map_p50_ns"]   = percentile(map_ns, 0.50);
+        state.counters["map_p99_ns"]   = percentile(map_ns, 0.99);
+        state.counters["unmap_p50_ns"] = percentile(unmap_ns, 0.50);
+        state.counters["unmap_p99_ns"] = percentile(unmap_ns, 0.99);
+    }
+
+    void BM_PkeySet(benchmark::State& state)
+    {
+        auto key            = vma_pkey();
+        unsigned int rights = 0;
+        for(auto _ : state)
+        {
+            pkru_pkey_set(key, rights);
+            rights ^= 0x2;
+        }
+        pkru_pkey_set(key, 0);
+        state.SetItemsProcessed(state.iterations());
+    }
+
+    // a mix of addresses inside and outside the region, so branches cannot be predicted
+    std::vector<const void*> probe_addresses(size_t count)
+    {
+        std::vector<const void*> ptrs;
+        std::mt19937 rng(1);
+        static int outside = 0;
+        auto inside        = pk_map(page);
+        for(size_t i = 0; i < count; ++i)
+        {
+            ptrs.push_back(rng() % 2 ? inside : &outside);
+        }
+        return ptrs;
+    }
+
+    void BM_IsSafeAddress(benchmark::State& state)
+    {
+        auto ptrs = probe_addresses(1024);
+        for(auto _ : state)
+        {
+            for(auto p : ptrs)
+            {
+                benchmark::DoNotOptimize(is_safe_address(const_cast<void*>(p)));
+            }
+        }
+        state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(ptrs.size()));
+    }
+
+    void BM_IsSafeAddressInline(benchmark::State& state)
+    {
+        auto ptrs = probe_addresses(1024);
+        for(auto _ : state)
+        {
+            for(auto p : ptrs)
+            {
+                benchmark::DoNotOptimize(pk_is_safe_address(p));
+            }
+        }
+        state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(ptrs.size()));
+    }
+
+    void BM_ClassifyPointers(benchmark::State& state)
+    {
+        auto ptrs = probe_addresses(1024);
+        std::vector<uint8_t> out(ptrs.size());
+        for(auto _ : state)
+        {
+            benchmark::DoNotOptimize(classify_pointers(ptrs.data(), ptrs.size(), out.data()));
+            benchmark::ClobberMemory();
+        }
+        state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(ptrs.size()));
+    }
+}        // namespace
+
+BENCHMARK_TEMPLATE(BM_MapUnmap, pk_map, pk_unmap)
+  ->RangeMultiplier(16)
+  ->Range(4096, 16 << 20)
+  ->ThreadRange(1, max_threads());
+BENCHMARK_TEMPLATE(BM_MapUnmap, os_map, os_unmap)
+  ->RangeMultiplier(16)
+  ->Range(4096, 16 << 20)
+  ->ThreadRange(1, max_threads());
+BENCHMARK_TEMPLATE(BM_MapUnmapMixed, pk_map, pk_unmap)->ThreadRange(1, max_threads());
+BENCHMARK_TEMPLATE(BM_MapUnmapMixed, os_map, os_unmap)->ThreadRange(1, max_threads());
+BENCHMARK_TEMPLATE(BM_MapUnmapFragmented, pk_map, pk_unmap)
+  ->Args({1024, 256 << 10})
+  ->Args({16384, 256 << 10})
+  ->Args({16384, 1 << 20});
+BENCHMARK_TEMPLATE(BM_MapUnmapFragmented, os_map, os_unmap)
+  ->Args({1024, 256 << 10})
+  ->Args({16384, 256 << 10})
+  ->Args({16384, 1 << 20});
+BENCHMARK_TEMPLATE(BM_MapLatency, pk_map, pk_unmap)->Arg(4096)->Arg(1 << 20)->Iterations(100000);
+BENCHMARK_TEMPLATE(BM_MapLatency, os_map, os_unmap)->Arg(4096)->Arg(1 << 20)->Iterations(100000);
+BENCHMARK(BM_PkeySet);
+BENCHMARK(BM_IsSafeAddress);
+BENCHMARK(BM_IsSafeAddressInline);
+BENCHMARK(BM_ClassifyPointers);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,78 @@
+// classify.hpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef ALLOCATOR_CLASSIFY_HPP
+#define ALLOCATOR_CLASSIFY_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace alloc
+{
+    /**
+     * Checks whether pointers fall in an address range [start, end), in bulk.
+     *
+     * A pointer p is in the range iff p - start < end - start as unsigned numbers, so every check is one subtraction
+     * and one compare, with no branches. pointers() picks the widest kernel the CPU supports at run time.
+     */
+    namespace classify
+    {
+        /**
+         * @return true if p lies in [start, end)
+         */
+        inline bool contains(uintptr_t start, uintptr_t end, const void* p) noexcept
+        {
+            return reinterpret_cast<uintptr_t>(p) - start < end - start;
+        }
+
+        /**
+         * @return true if all of [p, p + len) lies in [start, end). Empty ranges are never contained
+         */
+        inline bool contains_range(uintptr_t start, uintptr_t end, const void* p, size_t len) noexcept
+        {
+            auto offset = reinterpret_cast<uintptr_t>(p) - start;
+            return offset < end - start && len != 0 && len <= end - start - offset;
+        }
+
+        /**
+         * Classifies each pointer
+         * @param ptrs the pointers to check
+         * @param n number of pointers
+         * @param out out[i] is set to 1 if ptrs[i] lies in [start, end), and to 0 otherwise
+         * @return the number of pointers in the range
+         */
+        size_t pointers(uintptr_t start, uintptr_t end, const void* const* ptrs, size_t n, uint8_t* out) noexcept;
+
+        // the individual kernels, exposed for testing. Only call the vector ones if the CPU supports them
+        size_t pointers_scalar(uintptr_t start, uintptr_t end, const void* const* ptrs, size_t n,
+                               uint8_t* out) noexcept;
+        size_t pointers_avx2(uintptr_t start, uintptr_t end, const void* const* ptrs, size_t n,
+                             uint8_t* out) noexcept;
+        size_t pointers_avx512(uintptr_t start, uintptr_t end, const void* const* ptrs, size_t n,
+                               uint8_t* out) noexcept;
+        bool has_avx2() noexcept;
+        bool has_avx512() noexcept;
+    }        // namespace classify
+}        // namespace alloc
+
+#endif        // ALLOCATOR_CLASSIFY_HPP
@@ -0,0 +1,72 @@
+// domain.hpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef ALLOCATOR_DOMAIN_HPP
+#define ALLOCATOR_DOMAIN_HPP
+
+#include "vma.hpp"
+
+#include <cstddef>
+
+namespace alloc
+{
+    /**
+     * Registry of protection domains. Each domain is a vma with its own reservation, pkey, shards and locks, so
+     * domains never contend with each other.
+     *
+     * The address space is split into 1 GiB slots, and a table records which domain each slot belongs to, so finding
+     * the domain of an address is one table load and one bounds check. Only a slot shared by the ends of two small
+     * domains needs more: it falls back to checking every domain. Domains live until the process exits.
+     */
+    namespace domain
+    {
+        constexpr size_t max_domains = 16;        /// one per pkey
+
+        /**
+         * Registers an existing vma as a domain
+         * @param backing the vma. It must outlive every lookup
+         * @return false if the registry is full
+         */
+        bool add(vma* backing) noexcept;
+
+        /**
+         * Reserves and registers a new domain
+         * @param size size of the reservation in bytes, or 0 for utils::default_domain_size. Rounded up to a page
+         * @return the new domain, or nullptr with errno set: EINVAL if the size is larger than utils::default_size,
+         * ENOSPC if every domain or pkey is in use, ENOMEM if the domain could not be allocated or its region reserved
+         */
+        vma* create(size_t size) noexcept;
+
+        /**
+         * @return the domain whose reservation contains addr, or nullptr if there is none
+         */
+        vma* of(const void* addr) noexcept;
+
+        /**
+         * @return the number of registered domains
+         */
+        size_t count() noexcept;
+    }        // namespace domain
+}        // namespace alloc
+
+#endif        // ALLOCATOR_DOMAIN_HPP
@@ -0,0 +1,87 @@
+// extent_hooks.hpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef ALLOCATOR_EXTENT_HOOKS_HPP
+#define ALLOCATOR_EXTENT_HOOKS_HPP
+
+#include "vma.hpp"
+
+#if __has_include(<jemalloc/jemalloc.h>)
+#include <jemalloc/jemalloc.h>
+#else
+// the extent hook interface of jemalloc 5, declared here so the adapter builds without jemalloc's headers
+extern "C"
+{
+    typedef struct extent_hooks_s extent_hooks_t;
+
+    typedef void*(extent_alloc_t)(extent_hooks_t*, void*, size_t, size_t, bool*, bool*, unsigned);
+    typedef bool(extent_dalloc_t)(extent_hooks_t*, void*, size_t, bool, unsigned);
+    typedef void(extent_destroy_t)(extent_hooks_t*, void*, size_t, bool, unsigned);
+    typedef bool(extent_commit_t)(extent_hooks_t*, void*, size_t, size_t, size_t, unsigned);
+    typedef bool(extent_decommit_t)(extent_hooks_t*, void*, size_t, size_t, size_t, unsigned);
+    typedef bool(extent_purge_t)(extent_hooks_t*, void*, size_t, size_t, size_t, unsigned);
+    typedef bool(extent_split_t)(extent_hooks_t*, void*, size_t, size_t, size_t, bool, unsigned);
+    typedef bool(extent_merge_t)(extent_hooks_t*, void*, size_t, void*, size_t, bool, unsigned);
+
+    struct extent_hooks_s
+    {
+        extent_alloc_t* alloc;
+        extent_dalloc_t* dalloc;
+        extent_destroy_t* destroy;
+        extent_commit_t* commit;
+        extent_decommit_t* decommit;
+        extent_purge_t* purge_lazy;
+        extent_purge_t* purge_forced;
+        extent_split_t* split;
+        extent_merge_t* merge;
+    };
+}
+#endif
+
+namespace alloc
+{
+    /**
+     * jemalloc extent hooks that place an arena's extents in a vma, so jemalloc can manage the trusted heap.
+     *
+     * Install with mallctl("arena.<i>.extent_hooks") or when creating an arena with "arenas.create". Extents are always
+     * committed PROT_READ | PROT_WRITE with the vma's pkey. The vma only tracks free memory, so splitting or merging
+     * mapped extents needs no bookkeeping: both are O(1), and merge only refuses extents owned by different shards.
+     */
+    struct vma_extent_hooks
+    {
+        extent_hooks_t hooks;        // must come first: jemalloc hands a pointer to it back to every hook
+        vma* backing;
+
+        explicit vma_extent_hooks(vma* backing) noexcept;
+
+        /**
+         * Recovers the adapter from the hooks pointer jemalloc passes to a hook
+         */
+        static vma* backing_of(extent_hooks_t* hooks) noexcept
+        {
+            return reinterpret_cast<vma_extent_hooks*>(hooks)->backing;
+        }
+    };
+}        // namespace alloc
+
+#endif        // ALLOCATOR_EXTENT_HOOKS_HPP
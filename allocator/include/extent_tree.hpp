@@ -0,0 +1,329 @@
+// extent_tree.hpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef ALLOCATOR_EXTENT_TREE_HPP
+#define ALLOCATOR_EXTENT_TREE_HPP
+
+#include "freelist_node.hpp"
+
+#include <cstdint>
+
+namespace alloc
+{
+    /**
+     * Orders extents by their start address
+     */
+    struct address_order
+    {
+        bool operator()(const freelist_node* lhs, const freelist_node* rhs) const noexcept
+        {
+            return lhs->start < rhs->start;
+        }
+
+        bool operator()(const freelist_node* lhs, const void* addr) const noexcept
+        {
+            return lhs->start < addr;
+        }
+
+        bool operator()(const void* addr, const freelist_node* rhs) const noexcept
+        {
+            return addr < rhs->start;
+        }
+    };
+
+    /**
+     * Orders extents by their size, breaking ties by start address
+     */
+    struct size_order
+    {
+        static size_t extent_size(const freelist_node* node) noexcept
+        {
+            return static_cast<char*>(node->end) - static_cast<char*>(node->start);
+        }
+
+        bool operator()(const freelist_node* lhs, const freelist_node* rhs) const noexcept
+        {
+            auto lsize = extent_size(lhs);
+            auto rsize = extent_size(rhs);
+            return lsize < rsize || (lsize == rsize && lhs->start < rhs->start);
+        }
+
+        bool operator()(const freelist_node* lhs, size_t size) const noexcept
+        {
+            return extent_size(lhs) < size;
+        }
+
+        bool operator()(size_t size, const freelist_node* rhs) const noexcept
+        {
+            return size < extent_size(rhs);
+        }
+    };
+
+    /**
+     * An intrusive treap over freelist_nodes. The tree never allocates: its links live in the node member selected by
+     * Link, so a node can sit in several trees at once. Priorities are derived from the node's address, which keeps
+     * the expected depth logarithmic without storing any extra state.
+     *
+     * A node's key may be changed in place only if doing so does not change its position relative to its neighbors.
+     */
+    template <tree_link freelist_node::*Link, typename Compare>
+    class extent_tree
+    {
+    public:
+        extent_tree() noexcept = default;
+
+        bool empty() const noexcept
+        {
+            return root == nullptr;
+        }
+
+        /**
+         * Forgets every node in the tree without touching them
+         */
+        void clear() noexcept
+        {
+            root = nullptr;
+        }
+
+        node_ptr first() const noexcept
+        {
+            return root ? leftmost(root) : nullptr;
+        }
+
+        node_ptr last() const noexcept
+        {
+            return root ? rightmost(root) : nullptr;
+        }
+
+        static node_ptr next(node_ptr node) noexcept
+        {
+            if((node->*Link).right)
+            {
+                return leftmost((node->*Link).right);
+            }
+
+            auto parent = (node->*Link).parent;
+            while(parent && (parent->*Link).right == node)
+            {
+                node   = parent;
+                parent = (parent->*Link).parent;
+            }
+            return parent;
+        }
+
+        static node_ptr prev(node_ptr node) noexcept
+        {
+            if((node->*Link).left)
+            {
+                return rightmost((node->*Link).left);
+            }
+
+            auto parent = (node->*Link).parent;
+            while(parent && (parent->*Link).left == node)
+            {
+                node   = parent;
+                parent = (parent->*Link).parent;
+            }
+            return parent;
+        }
+
+        /**
+         * @return the first node that does not order before key, or nullptr
+         */
+        template <typename Key>
+        node_ptr lower_bound(const Key& key) const noexcept
+        {
+            node_ptr ret = nullptr;
+            for(auto curr = root; curr != nullptr;)
+            {
+                if(Compare()(curr, key))
+                {
+                    curr = (curr->*Link).right;
+                }
+                else
+                {
+                    ret  = curr;
+                    curr = (curr->*Link).left;
+                }
+            }
+            return ret;
+        }
+
+        /**
+         * @return the first node that orders after key, or nullptr
+         */
+        template <typename Key>
+        node_ptr upper_bound(const Key& key) const noexcept
+        {
+            node_ptr ret = nullptr;
+            for(auto curr = root; curr != nullptr;)
+            {
+                if(Compare()(key, curr))
+                {
+                    ret  = curr;
+                    curr = (curr->*Link).left;
+                }
+                else
+                {
+                    curr = (curr->*Link).right;
+                }
+            }
+            return ret;
+        }
+
+        void insert(node_ptr node) noexcept
+        {
+            auto& link = node->*Link;
+            link.left  = nullptr;
+            link.right = nullptr;
+
+            // find the leaf slot for the node
+            node_ptr parent = nullptr;
+            node_ptr* slot  = &root;
+            while(*slot)
+            {
+                parent = *slot;
+                slot   = Compare()(node, parent) ? &(parent->*Link).left : &(parent->*Link).right;
+            }
+            link.parent = parent;
+            *slot       = node;
+
+            // restore the heap property
+            while(link.parent && priority(link.parent) < priority(node))
+            {
+                rotate_up(node);
+            }
+        }
+
+        void erase(node_ptr node) noexcept
+        {
+            // rotate the node down until it is a leaf, then unlink it
+            for(;;)
+            {
+                auto& link = node->*Link;
+                if(!link.left && !link.right)
+                {
+                    break;
+                }
+
+                node_ptr child;
+                if(!link.left)
+                {
+                    child = link.right;
+                }
+                else if(!link.right)
+                {
+                    child = link.left;
+                }
+                else
+                {
+                    child = priority(link.left) > priority(link.right) ? link.left : link.right;
+                }
+                rotate_up(child);
+            }
+            replace_child((node->*Link).parent, node, nullptr);
+        }
+
+    private:
+        node_ptr root = nullptr;
+
+        static node_ptr leftmost(node_ptr node) noexcept
+        {
+            while((node->*Link).left)
+            {
+                node = (node->*Link).left;
+            }
+            return node;
+        }
+
+        static node_ptr rightmost(node_ptr node) noexcept
+        {
+            while((node->*Link).right)
+            {
+                node = (node->*Link).right;
+            }
+            return node;
+        }
+
+        static uint64_t priority(node_ptr node) noexcept
+        {
+            // mix the node's address (splitmix64 finalizer)
+            auto x = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(node));
+            x      = (x ^ (x >> 30U)) * 0xbf58476d1ce4e5b9ULL;
+            x      = (x ^ (x >> 27U)) * 0x94d049bb133111ebULL;
+            return x ^ (x >> 31U);
+        }
+
+        void replace_child(node_ptr parent, node_ptr old_child, node_ptr new_child) noexcept
+        {
+            if(!parent)
+            {
+                root = new_child;
+            }
+            else if((parent->*Link).left == old_child)
+            {
+                (parent->*Link).left = new_child;
+            }
+            else
+            {
+                (parent->*Link).right = new_child;
+            }
+        }
+
+        // rotate node above its parent
+        void rotate_up(node_ptr node) noexcept
+        {
+            auto& link       = node->*Link;
+            auto parent      = link.parent;
+            auto& plink      = parent->*Link;
+            auto grandparent = plink.parent;
+
+            if(plink.left == node)
+            {
+                plink.left = link.right;
+                if(link.right)
+                {
+                    (link.right->*Link).parent = parent;
+                }
+                link.right = parent;
+            }
+            else
+            {
+                plink.right = link.left;
+                if(link.left)
+                {
+                    (link.left->*Link).parent = parent;
+                }
+                link.left = parent;
+            }
+
+            plink.parent = node;
+            link.parent  = grandparent;
+            replace_child(grandparent, parent, node);
+        }
+    };
+
+    using address_tree = extent_tree<&freelist_node::addr_link, address_order>;
+    using size_tree    = extent_tree<&freelist_node::size_link, size_order>;
+}        // namespace alloc
+
+#endif        // ALLOCATOR_EXTENT_TREE_HPP
@@ -23,27 +23,48 @@
 #ifndef ALLOCATOR_FREELIST_HPP
 #define ALLOCATOR_FREELIST_HPP
 
+#include "extent_tree.hpp"
 #include "freelist_node.hpp"
 #include "internal_arena.hpp"
 #include "internal_arena_allocator.hpp"
+#include "placement.hpp"
 #include "utilities.hpp"
 
 #include <cassert>
+#include <cstdint>
 
 namespace alloc
 {
 
-    class freelist
+    /**
+     * Tracks the free extents of a region. Extents are indexed both by address, for fixed requests and coalescing,
+     * and by size, for best-fit placement, so every operation is logarithmic in the number of free extents.
+     *
+     * Small extents are kept in segregated size bins instead of the size index: one bin per page count up to
+     * exact_bins pages, then one bin per power of two up to large_pages. Requests served from the bins are O(1).
+     *
+     * Where new requests are placed is left to a placement policy, see basic_freelist and placement.hpp.
+     */
+    class freelist_base
     {
+        friend struct segregated_fit;
+        friend struct first_fit;
+        friend struct next_fit;
+        friend struct best_fit;
+        friend struct address_best_fit;
 
     public:
+        static constexpr size_t exact_bins  = 64;               /// extents of 1..exact_bins pages have exact bins
+        static constexpr size_t large_pages = 1UL << 16U;        /// extents of at least this many pages use the tree
+        static constexpr size_t bin_count   = exact_bins + 10;        /// exact bins, then power of two bins
+
         static void fake_deleter(void* ptr) {}
 
-        freelist(void* start, void* end);
+        freelist_base(void* start, void* end);
 
-        freelist();
+        freelist_base();
 
-        ~freelist();
+        ~freelist_base();
 
         void* split_node(void* ptr, size_t size);
 
@@ -57,35 +78,112 @@ namespace alloc
 
         node_ptr search(void* addr);
 
-        void* request(void* addr, size_t size, size_t align);
-
-        void* request(size_t size)
-        {
-            return request(nullptr, size, utils::default_alignment);
-        }
-
         void return_region(void* addr, size_t size);
 
+        /**
+         * Takes the first free extent overlapping [begin, end) out of the list, clipped to that range
+         * @param begin start of the range
+         * @param end end of the range
+         * @param length set to the size of the extent taken
+         * @return the start of the extent taken, or nullptr if no part of the range is free
+         */
+        void* take_free(void* begin, void* end, size_t& length);
+
         void init(void* start, void* end);
 
+        /**
+         * Initializes the freelist with its metadata kept apart from the region it manages
+         * @param meta start of the memory used for list nodes
+         * @param meta_len size of the memory used for list nodes
+         * @param start start of the free region. If start == end the list starts out empty
+         * @param end end of the free region
+         */
+        void init(void* meta, size_t meta_len, void* start, void* end);
+
         void release_freelist();
         ptrdiff_t mem_available();
 
+        /**
+         * @return the number of free extents, maintained incrementally
+         */
+        size_t extent_count() const;
+
+        /**
+         * @return the size of the largest free extent in bytes. The largest size in each power of two bin is kept as
+         * extents come and go. Once every extent of that size has left a bin, the next call walks the bin to find its
+         * new largest. The cost is amortized: one walk, linear in the bin's length, each time a bin's largest size
+         * empties out, and O(1) otherwise. Only statistics call this, never the allocation path
+         */
+        size_t largest_extent() const;
+
         bool is_mapped_node(node_ptr ptr) const;
 
     private:
-        node_ptr head;
-        node_ptr tail;
+        address_tree by_addr;
+        size_tree by_size;
+        node_ptr bins[bin_count];
+        uint64_t bin_map[(bin_count + 63) / 64];        // bit i is set if bins[i] is not empty
+
+        // the largest extent in each power of two bin, and how many extents of that size it holds. A count of 0 in a
+        // non-empty bin means the largest extent left, and the size is found again on the next largest_extent()
+        mutable size_t bin_largest[bin_count - exact_bins];
+        mutable size_t bin_largest_count[bin_count - exact_bins];
+        size_t free_bytes;                              // total size of all free extents
+        size_t extents;                                 // number of free extents
         node_ptr list_ary;
         internal_arena arena;
 
-        void* find_first_block(size_t align, size_t new_size);
+        static bool fits(const freelist_node& node, size_t align, size_t new_size);
         void* aligned_alloc(size_t align, size_t new_size, freelist_node& curr);
+        void* carve(node_ptr target, char* addr, size_t size);
+        void resize_node(node_ptr node, void* start, void* end);
+        void index_node(node_ptr node);
+        void unindex_node(node_ptr node);
+        node_ptr find_bin(size_t first_bin) const;
+        static size_t bin_index(size_t pages);
         node_ptr alloc_list_node() const;
         void dealloc_list_node(freelist_node* node) const;
         void init_list_head(void* start, void* end);
     };
 
+    /**
+     * A freelist that places requests with the given policy. The policy is fixed at compile time, so placing a request
+     * costs a direct call, with no dispatch
+     */
+    template <typename Placement>
+    class basic_freelist : public freelist_base
+    {
+    public:
+        using freelist_base::freelist_base;
+
+        void* request(void* addr, size_t size, size_t align)
+        {
+            // no zero sized allocations
+            if(size == 0)
+                return nullptr;
+
+            auto new_size = utils::get_aligned_size(size, utils::min_alignment);
+            if(!addr)
+            {
+                return placement.find(*this, align, new_size);
+            }
+
+            // if the request if for a fixed mapping, try to satisfy it
+            return split_node(utils::get_aligned(addr, align), new_size);
+        }
+
+        void* request(size_t size)
+        {
+            return request(nullptr, size, utils::default_alignment);
+        }
+
+    private:
+        Placement placement;        // the policy's own state, such as next_fit's roving pointer
+    };
+
+    /// the freelist used by every vma, chosen with the PKALLOC_PLACEMENT build option
+    using freelist = basic_freelist<default_placement>;
+
 }        // end namespace alloc
 
 #endif        // ALLOCATOR_FREELIST_HPP
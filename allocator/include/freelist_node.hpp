@@ -27,13 +27,39 @@
 
 namespace alloc
 {
+    class freelist_node;
+
+    /**
+     * Intrusive links used to place a freelist_node in an extent_tree
+     */
+    struct tree_link
+    {
+        freelist_node* parent;
+        freelist_node* left;
+        freelist_node* right;
+    };
+
+    /**
+     * Intrusive links used to place a freelist_node in a doubly linked list
+     */
+    struct list_link
+    {
+        freelist_node* prev;
+        freelist_node* next;
+    };
+
     class freelist_node
     {
     public:
         using node_ptr = freelist_node*;
-        node_ptr next;
         void* start;
         void* end;
+        tree_link addr_link;        // links in the address ordered index
+        union
+        {
+            tree_link size_link;        // links in the size ordered index, for large extents
+            list_link bin_link;         // links in a size bin, for small extents
+        };
 
         freelist_node()  = default;
         ~freelist_node() = default;
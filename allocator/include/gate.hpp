@@ -0,0 +1,292 @@
+// gate.hpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef ALLOCATOR_GATE_HPP
+#define ALLOCATOR_GATE_HPP
+
+#include "pkru.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <x86intrin.h>
+
+namespace alloc
+{
+    /**
+     * Call gates between the untrusted and trusted domains.
+     *
+     * Each thread keeps a stack of the PKRU values in effect when it entered each gate, so leaving a gate restores
+     * the previous value exactly, however the gates are nested. All PKRU accesses go through the thread-local
+     * shadow, so a gate that would not change the rights, such as entering the trusted domain from inside it, costs
+     * neither an RDPKRU nor a serializing WRPKRU.
+     *
+     * Entries into the trusted domain are counted per thread, and summed when read. Gates may also be tagged with a
+     * site, which records a histogram of the cycles spent switching PKRU while profiling is enabled.
+     */
+    namespace gate
+    {
+        constexpr unsigned int max_depth         = 64;        /// deepest supported nesting of gates per thread
+        constexpr unsigned int histogram_buckets = 32;        /// bucket i counts switches of [2^i, 2^(i+1)) cycles
+
+        struct frame_stack
+        {
+            unsigned int depth;
+            unsigned int saved[max_depth];        // PKRU to restore when leaving each gate
+            uint64_t keyless;                     // bit i is set if gate i got pkey -1 and left PKRU alone
+        };
+
+        static_assert(max_depth <= 64, "keyless holds one bit per gate");
+
+        inline thread_local frame_stack frames __attribute__((tls_model("initial-exec"))) = {};
+
+        /**
+         * A thread's gate counters. States are never freed: a new thread adopts the state of one that has exited, so
+         * the sum over all states stays correct without ever folding counters together
+         */
+        struct thread_state
+        {
+            std::atomic<uint64_t> crossings;        // only written by the owning thread
+            std::atomic<bool> in_use;
+            thread_state* next;
+        };
+
+        inline thread_local thread_state* state __attribute__((tls_model("initial-exec"))) = nullptr;
+
+        /**
+         * Gives the calling thread a counter state
+         */
+        thread_state* attach() noexcept;
+
+        /**
+         * @return the number of entries into the trusted domain made by all threads. Lock free, so it may be called
+         * from a signal handler
+         */
+        uint64_t crossings() noexcept;
+
+        /**
+         * Counts an entry into the trusted domain
+         */
+        [[gnu::always_inline]] inline void count() noexcept
+        {
+            auto s = state;
+            if(__builtin_expect(s == nullptr, 0))
+            {
+                s = attach();
+            }
+            s->crossings.store(s->crossings.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        /**
+         * A gate site, for profiling. Define one per call site with static storage duration; it is registered the
+         * first time it records a switch. Matches struct pk_gate_site in safemap.h
+         */
+        struct site
+        {
+            const char* name;
+            uint64_t buckets[histogram_buckets];        // updated with relaxed atomic adds
+            site* next;                                 // next registered site
+            int registered;
+        };
+
+        inline std::atomic<bool> profiling(false);
+
+        /**
+         * Adds a switch of the given length to the site's histogram
+         */
+        void record(site& s, uint64_t cycles) noexcept;
+
+        /**
+         * @return the most recently registered site, or nullptr. Follow site::next for the others
+         */
+        site* first_site() noexcept;
+
+        /**
+         * Abort on unbalanced gates; an unmatched exit could otherwise leave the trusted domain open
+         */
+        [[noreturn]] void overflow() noexcept;
+        [[noreturn]] void underflow() noexcept;
+
+        [[gnu::always_inline]] inline void enter(int pkey, unsigned int rights) noexcept
+        {
+            auto& f = frames;
+            if(__builtin_expect(f.depth == max_depth, 0))
+            {
+                overflow();
+            }
+
+            // without protection keys there are no rights to switch, and PKRU may not even exist, but the gate must
+            // still be left with exit()
+            if(__builtin_expect(pkey == -1, 0))
+            {
+                f.keyless |= 1UL << f.depth++;
+                return;
+            }
+
+            auto current = pkru::shadow::read();
+            f.keyless &= ~(1UL << f.depth);
+            f.saved[f.depth++] = current;
+            pkru::shadow::write(pkru::with_rights(current, pkey, rights));
+        }
+
+        /**
+         * Grants the thread access to memory protected by pkey, until the matching exit(). With pkey -1, as on hosts
+         * without protection keys, the gate leaves PKRU alone
+         */
+        [[gnu::always_inline]] inline void enter_trusted(int pkey) noexcept
+        {
+            count();
+            enter(pkey, 0);
+        }
+
+        /**
+         * Revokes the thread's access to memory protected by pkey, until the matching exit(), e.g. to call back into
+         * untrusted code from a trusted one
+         */
+        [[gnu::always_inline]] inline void enter_untrusted(int pkey) noexcept
+        {
+            enter(pkey, pkru::access_disable);
+        }
+
+        /**
+         * Leaves the most recently entered gate, restoring the PKRU in effect before it
+         */
+        [[gnu::always_inline]] inline void exit() noexcept
+        {
+            auto& f = frames;
+            if(__builtin_expect(f.depth == 0, 0))
+            {
+                underflow();
+            }
+            --f.depth;
+            if(__builtin_expect((f.keyless >> f.depth) & 1U, 0))
+            {
+                return;
+            }
+            pkru::shadow::write(f.saved[f.depth]);
+        }
+
+        /**
+         * The same gates, timed into the histogram of a site while profiling is enabled
+         */
+        [[gnu::always_inline]] inline void enter_trusted(int pkey, site& s) noexcept
+        {
+            if(!profiling.load(std::memory_order_relaxed))
+            {
+                enter_trusted(pkey);
+                return;
+            }
+            auto start = __rdtsc();
+            enter_trusted(pkey);
+            record(s, __rdtsc() - start);
+        }
+
+        [[gnu::always_inline]] inline void enter_untrusted(int pkey, site& s) noexcept
+        {
+            if(!profiling.load(std::memory_order_relaxed))
+            {
+                enter_untrusted(pkey);
+                return;
+            }
+            auto start = __rdtsc();
+            enter_untrusted(pkey);
+            record(s, __rdtsc() - start);
+        }
+
+        [[gnu::always_inline]] inline void exit(site& s) noexcept
+        {
+            if(!profiling.load(std::memory_order_relaxed))
+            {
+                exit();
+                return;
+            }
+            auto start = __rdtsc();
+            exit();
+            record(s, __rdtsc() - start);
+        }
+
+        /**
+         * @return the number of gates the thread is currently inside
+         */
+        [[gnu::always_inline]] inline unsigned int depth() noexcept
+        {
+            return frames.depth;
+        }
+    }        // namespace gate
+
+    /**
+     * Holds the trusted domain open for the lifetime of the scope
+     */
+    class trusted_scope
+    {
+    public:
+        explicit trusted_scope(int pkey) noexcept : where(nullptr)
+        {
+            gate::enter_trusted(pkey);
+        }
+
+        trusted_scope(int pkey, gate::site& where) noexcept : where(&where)
+        {
+            gate::enter_trusted(pkey, where);
+        }
+
+        ~trusted_scope() noexcept
+        {
+            if(where)
+            {
+                gate::exit(*where);
+            }
+            else
+            {
+                gate::exit();
+            }
+        }
+
+        trusted_scope(const trusted_scope&) = delete;
+        trusted_scope& operator=(const trusted_scope&) = delete;
+
+    private:
+        gate::site* where;
+    };
+
+    /**
+     * Closes the trusted domain for the lifetime of the scope, e.g. around a callback into untrusted code
+     */
+    class untrusted_scope
+    {
+    public:
+        explicit untrusted_scope(int pkey) noexcept
+        {
+            gate::enter_untrusted(pkey);
+        }
+
+        ~untrusted_scope() noexcept
+        {
+            gate::exit();
+        }
+
+        untrusted_scope(const untrusted_scope&) = delete;
+        untrusted_scope& operator=(const untrusted_scope&) = delete;
+    };
+}        // namespace alloc
+
+#endif        // ALLOCATOR_GATE_HPP
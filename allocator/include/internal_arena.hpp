@@ -30,10 +30,17 @@ namespace alloc
 {
     /**
      * A bump arena allocator to use when bootstrapping other allocators, i.e. jemalloc
+     *
+     * Freed blocks of up to max_pooled bytes are kept in per size class free lists and handed out again before the
+     * arena bumps into fresh memory, so a stream of allocations and frees of the same size never grows the arena.
+     * The backing region may be reserved but not yet touched: pages are only faulted in as the arena grows into them.
      */
     class internal_arena
     {
     public:
+        static constexpr size_t pool_granularity = 16;        /// pooled sizes are rounded up to this many bytes
+        static constexpr size_t max_pooled       = 256;        /// largest allocation recycled through the pools
+
         /**
          * default Constructor
          */
@@ -47,19 +54,17 @@ namespace alloc
         void init(void* start_addr, size_t len);
 
         /**
-         * Allocates a region of n bytes with alignment align,
-         * allocation requests exceeding the range of the region
-         * are backed by the default allocator through operator new()
+         * Allocates a region of n bytes with alignment align. Recycled blocks are used first; otherwise the arena
+         * grows into its backing region.
          * @param n size of allocation
          * @param align alignment
-         * @return pointer to the start of the allocated region
+         * @return pointer to the start of the allocated region, or nullptr if the backing region is exhausted
          */
         void* allocate(size_t n, size_t align);
 
         /**
-         * dealocates memory from the region. Memory from the backed region is
-         * leaked, while allocations backed by the default allocator have
-         * delete called on them.
+         * dealocates memory from the region. Blocks small enough to be pooled are recycled by later allocations of
+         * the same size class, while larger blocks are leaked.
          * @param p pointer to the region to deallocate
          * @param n size of the allocation to deallocate
          */
@@ -73,10 +78,21 @@ namespace alloc
         bool in_arena(void* p);
 
     private:
-        void* start;          // pointer to start of arena
-        void* end;            // pointer to end of arena
-        size_t length;        // length of backed region
-        char* curr;           // pointer to the top of the arena
+        struct free_block
+        {
+            free_block* next;
+        };
+
+        static constexpr size_t pool_count = max_pooled / pool_granularity;
+
+        void* start;                        // pointer to start of arena
+        void* end;                          // pointer to end of arena
+        size_t length;                      // length of backed region
+        char* curr;                         // pointer to the top of the arena
+        free_block* pools[pool_count];        // recycled blocks, by size class
+
+        static bool is_pooled(size_t n, size_t align);
+        static size_t pool_index(size_t n);
     };
 }        // namespace alloc
 
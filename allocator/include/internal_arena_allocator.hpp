@@ -57,12 +57,7 @@ namespace alloc
 
             void deallocate(pointer p, size_t n)
             {
-
-                if(!arena->in_arena(p))
-                {
-                    ::delete(p);
-                }
-                // arena->dealocate(p, n* sizeof(T));
+                arena->dealocate(p, n * sizeof(T));
             }
 
             template <typename U>
@@ -31,6 +31,8 @@
 extern "C"
 {
 
+    // C++ callers should prefer the inline versions of the PKRU accessors in pkru.hpp
+
     /**
      * Wrapper for RDPKRU instruction
      * @return value of pkru register
@@ -0,0 +1,158 @@
+// pkru.hpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef ALLOCATOR_PKRU_HPP
+#define ALLOCATOR_PKRU_HPP
+
+namespace alloc
+{
+    /**
+     * Header-only access to the PKRU register, so that switching protection domains compiles down to the RDPKRU and
+     * WRPKRU instructions at the call site. Keys are not range checked: use the functions in mpk.h for that.
+     */
+    namespace pkru
+    {
+        constexpr int key_count               = 16;             /// number of protection keys
+        constexpr unsigned int access_disable = 0x1;            /// rights bit: no data access through the key
+        constexpr unsigned int write_disable  = 0x2;            /// rights bit: no writes through the key
+
+        /**
+         * @return the bits of PKRU that hold the rights of key
+         */
+        constexpr unsigned int key_mask(int key) noexcept
+        {
+            return 3U << (2U * static_cast<unsigned int>(key));
+        }
+
+        /**
+         * @return rights shifted into the position of key
+         */
+        constexpr unsigned int key_rights(int key, unsigned int rights) noexcept
+        {
+            return (rights & 3U) << (2U * static_cast<unsigned int>(key));
+        }
+
+        /**
+         * @return pkru with the rights of key replaced
+         */
+        constexpr unsigned int with_rights(unsigned int pkru, int key, unsigned int rights) noexcept
+        {
+            return (pkru & ~key_mask(key)) | key_rights(key, rights);
+        }
+
+        static_assert(key_mask(15) == 0xc0000000U, "each key has two bits of PKRU");
+        static_assert(with_rights(~0U, 1, 0) == 0xfffffff3U, "clearing a key's rights leaves the other keys alone");
+
+        /**
+         * @return the value of the PKRU register (RDPKRU)
+         */
+        [[gnu::always_inline]] inline unsigned int read() noexcept
+        {
+#if HAS_MPK
+            unsigned int result;
+            __asm__ volatile(".byte 0x0f, 0x01, 0xee" : "=a"(result) : "c"(0) : "rdx");
+            return result;
+#else
+            return 0;
+#endif
+        }
+
+        /**
+         * Overwrites the PKRU register (WRPKRU)
+         */
+        [[gnu::always_inline]] inline void write(unsigned int value) noexcept
+        {
+#if HAS_MPK
+            __asm__ volatile(".byte 0x0f, 0x01, 0xef" : : "a"(value), "c"(0), "d"(0) : "memory");
+#else
+            (void)value;
+#endif
+        }
+
+        [[gnu::always_inline]] inline unsigned int get(int key) noexcept
+        {
+            return (read() & key_mask(key)) >> (2U * static_cast<unsigned int>(key));
+        }
+
+        [[gnu::always_inline]] inline void set(int key, unsigned int rights) noexcept
+        {
+            write(with_rights(read(), key, rights));
+        }
+
+        /**
+         * A thread-local shadow of PKRU. Once primed, reads are served from the shadow instead of RDPKRU, and a write
+         * that would leave the register unchanged is skipped entirely.
+         *
+         * The shadow is only accurate while every write to PKRU on the thread goes through it. Call refresh() after
+         * anything else writes the register, such as glibc's pkey_set(). Signal handlers run with the kernel's default
+         * PKRU, so they must not use the shadow.
+         */
+        namespace shadow
+        {
+            // initial-exec keeps the accesses to a single %fs relative load or store
+            inline thread_local unsigned int value __attribute__((tls_model("initial-exec"))) = 0;
+            inline thread_local bool primed __attribute__((tls_model("initial-exec")))        = false;
+
+            /**
+             * Reloads the shadow from the register
+             */
+            [[gnu::always_inline]] inline void refresh() noexcept
+            {
+                value  = pkru::read();
+                primed = true;
+            }
+
+            [[gnu::always_inline]] inline unsigned int read() noexcept
+            {
+                if(__builtin_expect(!primed, 0))
+                {
+                    refresh();
+                }
+                return value;
+            }
+
+            [[gnu::always_inline]] inline void write(unsigned int pkru) noexcept
+            {
+                if(primed && pkru == value)
+                {
+                    return;
+                }
+                pkru::write(pkru);
+                value  = pkru;
+                primed = true;
+            }
+
+            [[gnu::always_inline]] inline unsigned int get(int key) noexcept
+            {
+                return (read() & key_mask(key)) >> (2U * static_cast<unsigned int>(key));
+            }
+
+            [[gnu::always_inline]] inline void set(int key, unsigned int rights) noexcept
+            {
+                write(with_rights(read(), key, rights));
+            }
+        }        // namespace shadow
+    }            // namespace pkru
+}        // namespace alloc
+
+#endif        // ALLOCATOR_PKRU_HPP
@@ -0,0 +1,98 @@
+// placement.hpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef ALLOCATOR_PLACEMENT_HPP
+#define ALLOCATOR_PLACEMENT_HPP
+
+#include <cstddef>
+
+namespace alloc
+{
+    class freelist_base;
+
+    /**
+     * Placement policies for basic_freelist. Each decides which free extent a request is carved from:
+     *     void* find(freelist_base& list, size_t align, size_t size);
+     * returns the start of the carved region, or nullptr if no extent can hold it. size is a whole number of pages.
+     * A policy object lives in its freelist, so it may keep state between requests.
+     */
+
+    /**
+     * Best fit among the segregated size bins, then the size index. Small requests are O(1); sizes that share a
+     * power of two bin are not told apart, so a small request may take a larger extent than it needs
+     */
+    struct segregated_fit
+    {
+        void* find(freelist_base& list, size_t align, size_t size) noexcept;
+    };
+
+    /**
+     * The lowest addressed extent that fits. Packs memory toward the start of the region, at the cost of a walk
+     * through the extents below the first that fits
+     */
+    struct first_fit
+    {
+        void* find(freelist_base& list, size_t align, size_t size) noexcept;
+    };
+
+    /**
+     * First fit, starting where the previous request ended and wrapping around. Spreads requests over the region, and
+     * avoids rescanning the small extents that first fit leaves near the start
+     */
+    struct next_fit
+    {
+        void* find(freelist_base& list, size_t align, size_t size) noexcept;
+
+    private:
+        void* rover = nullptr;        // end of the last region placed
+    };
+
+    /**
+     * The smallest extent that fits, leaving the largest extents intact
+     */
+    struct best_fit
+    {
+        void* find(freelist_base& list, size_t align, size_t size) noexcept;
+
+    protected:
+        static void* find_best(freelist_base& list, size_t align, size_t size, bool lowest_address) noexcept;
+    };
+
+    /**
+     * Best fit, breaking ties between extents of the same size by address. Keeps long-lived regions packed toward the
+     * start of the region, which tends to fragment least under long-running workloads
+     */
+    struct address_best_fit : private best_fit
+    {
+        void* find(freelist_base& list, size_t align, size_t size) noexcept;
+    };
+
+#ifndef PKALLOC_PLACEMENT
+#define PKALLOC_PLACEMENT segregated_fit
+#endif
+
+    /// the placement used by alloc::freelist, and so by every vma
+    using default_placement = PKALLOC_PLACEMENT;
+}        // namespace alloc
+
+#endif        // ALLOCATOR_PLACEMENT_HPP
@@ -0,0 +1,122 @@
+// ready_pool.hpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef ALLOCATOR_READY_POOL_HPP
+#define ALLOCATOR_READY_POOL_HPP
+
+#include "vma.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace alloc
+{
+    /**
+     * Usage of a ready pool since it was last configured
+     */
+    struct ready_stats
+    {
+        size_t held;             // bytes of ready regions waiting in the pool
+        uint64_t hits;           // requests served from the pool
+        uint64_t misses;         // requests of a pooled size that found the pool empty
+        uint64_t refills;        // regions mapped to top the pool up
+    };
+
+    /**
+     * An opt-in pool of regions of a few configured sizes, already mapped PROT_READ | PROT_WRITE with the vma's pkey
+     * and optionally prefaulted, so that a hit is a pointer pop with no syscall.
+     *
+     * Each size class holds up to depth regions. Every request that finds a class empty or leaves it below its
+     * low-water mark wakes a background thread to top it up again, so a refill that failed is retried.
+     */
+    class ready_pool
+    {
+    public:
+        static constexpr size_t max_classes = 8;        /// max number of pooled sizes
+        static constexpr int ready_prot     = PROT_READ | PROT_WRITE;        /// protections of pooled regions
+
+        explicit ready_pool(vma* backing) noexcept;
+
+        /**
+         * Stops the refill thread and unmaps every pooled region
+         */
+        ~ready_pool() noexcept;
+
+        /**
+         * Replaces the pool's configuration, and waits for every size class to be filled
+         * @param sizes region sizes to keep ready, in bytes. Rounded up to whole pages
+         * @param count number of sizes, at most max_classes. 0 disables the pool
+         * @param depth number of regions to keep of each size
+         * @param low_water a class is refilled once it holds fewer than this many regions
+         * @param prefault touch every page of a region before pooling it
+         * @return true on success, false if the configuration is invalid
+         */
+        bool configure(const size_t* sizes, size_t count, size_t depth, size_t low_water, bool prefault) noexcept;
+
+        /**
+         * Pops a ready region
+         * @param length size of the request in bytes
+         * @param prot requested page protections. Only ready_prot requests can be served
+         * @return the start of the region, or nullptr if the pool cannot satisfy the request
+         */
+        void* map(size_t length, int prot) noexcept;
+
+        void get_stats(ready_stats& stats) noexcept;
+
+    private:
+        struct size_class
+        {
+            std::mutex lock;
+            std::atomic<size_t> length;        // read without the lock to find the class, and checked again under it
+            std::vector<void*> regions;
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t refills;
+        };
+
+        vma* backing;
+        size_class classes[max_classes];
+        std::atomic<size_t> class_count;        // number of classes in use, 0 while the pool is disabled
+        size_t depth;
+        std::atomic<size_t> low_water;
+        bool prefault;
+
+        std::mutex refill_lock;
+        std::condition_variable refill_wake;
+        std::thread refiller;
+        bool refill_wanted;
+        bool stop_refiller;
+        uint64_t passes;        // number of refill passes completed
+
+        void fill(size_class& c) noexcept;
+        void refill_loop() noexcept;
+        void disable() noexcept;
+    };
+}        // namespace alloc
+
+#endif        // ALLOCATOR_READY_POOL_HPP
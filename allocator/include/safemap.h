@@ -24,25 +24,97 @@
 #define ALLOCATOR_SAFEMAP_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+/// aligned_map_region() flag: back the region with transparent huge pages
+#define PK_MAP_HUGEPAGE 0x1
+
+/// aligned_map_region() flag: fault the region in before returning it
+#define PK_MAP_POPULATE 0x2
+
+/// remap_region() flag: the region may be moved if it cannot grow in place
+#define PK_REMAP_MAYMOVE 0x1
+
+    /**
+     * Settings for the default domain. A field left as 0 is read from the environment, and failing that takes its
+     * default:
+     *     PKALLOC_SIZE    size of the reservation, e.g. 64G. Default 64 TiB
+     *     PKALLOC_ALIGN   alignment of the reservation, a power of two, e.g. 1G. Default 1 GiB
+     *     PKALLOC_RIGHTS  rights of the initializing thread to the pkey afterwards: rw, ro or none. Default rw. They
+     *                     apply once the call that reserves the domain returns, whether pk_init() or a lazy first use
+     *     PKALLOC_NUMA    1 to split the reservation across NUMA nodes, see map_region_on_node(). Default 0
+     */
+    struct pk_config
+    {
+        size_t size;               /// size of the reservation in bytes, at most 64 TiB
+        size_t alignment;          /// alignment of the start of the reservation, a power of two
+        unsigned int rights;       /// 0, PKEY_DISABLE_WRITE or PKEY_DISABLE_ACCESS
+        int numa;                  /// nonzero to bind a share of the reservation to each NUMA node
+    };
+
+    /**
+     * Reserves the default domain. Calling this is optional: otherwise the first call that needs the domain, such as
+     * map_region(), reserves it using the environment and defaults. Until then, is_safe_address() and friends report
+     * every address as unsafe
+     * @param config the settings, or NULL to use the environment and defaults
+     * @return 0 on success, or -1 with errno set: EINVAL for invalid settings, EBUSY if already initialized, ENOMEM if
+     * the region cannot be reserved, in which case pk_init() may be called again
+     */
+    int pk_init(const struct pk_config* config);
+
+    /**
+     * @return nonzero once the default domain has been reserved
+     */
+    int pk_initialized();
+
     /**
      * Maps a set of pages from a reserved pool, with a pkey set. Uses the same interface as mmap() syscall
      * @param addr The requested start address of a region. If null the first address that satisfies alignment
      * requirments
      * @param length The size of the requested region in bytes. Should be aligned to page boundaries
      * @param prot Requested page protections (see mmap(2))
-     * @param flags Flags
-     * @param fd Backing File descriptor (unsupported -- only use MAP_ANONYMOUS)
-     * @param offset Offset into mmaped file (unsupported -- only use 0)
+     * @param flags MAP_POPULATE faults the region in before returning it, with MADV_POPULATE_WRITE or by touching
+     * every page on kernels without it. Adding MAP_NONBLOCK leaves that to a background thread and returns at once.
+     * MAP_SHARED shares the region, see fd. Other flags are ignored
+     * @param fd A file to map in place of the reserved pages, such as a memfd shared with other processes, or -1.
+     * Together with MAP_SHARED, each process maps the same pages into its own reservation, under its own pkey. With
+     * MAP_SHARED and fd -1, the pages are shared with child processes instead. unmap_region() puts reserved pages back
+     * @param offset Offset into the file, a multiple of the page size
      * @return A pointer to the mapped region on success, or MAP_FAILED in case of error
      */
     void* map_region(void* addr, size_t length, int prot, int flags, int fd, ptrdiff_t offset);
 
+    /**
+     * Maps a set of pages from the reserved pool, with the start of the region aligned to any power of two, e.g. 2 MiB
+     * or 1 GiB. The region is carved from a free extent that can hold it at that alignment, so no memory is wasted.
+     * Unmap the region with unmap_region()
+     * @param length The size of the requested region in bytes
+     * @param alignment Required alignment of the region, a power of two. Alignments below a page are rounded up
+     * @param prot Requested page protections (see mmap(2))
+     * @param flags PK_MAP_HUGEPAGE, to apply MADV_HUGEPAGE to the region, and PK_MAP_POPULATE, to fault it in up
+     * front. Huge pages are a hint the kernel may ignore; align the region to 2 MiB for them to be used
+     * @return A pointer to the mapped region on success, or MAP_FAILED in case of error
+     */
+    void* aligned_map_region(size_t length, size_t alignment, int prot, int flags);
+
+    /**
+     * Resizes a region mapped by map_region(), keeping its contents and protections. Same as mremap() syscall.
+     * Shrinking always happens in place. Growing happens in place if the pages after the region are free, and
+     * otherwise moves the region without copying it, if PK_REMAP_MAYMOVE is set. Other threads must not use the region
+     * while it is resized. A region mapped from a file or shared memory can only shrink: growing it fails with EINVAL
+     * @param addr Start address of the region. Must be page aligned
+     * @param old_length Current size of the region in bytes
+     * @param new_length Requested size of the region in bytes
+     * @param flags 0 or PK_REMAP_MAYMOVE
+     * @return A pointer to the resized region on success, or MAP_FAILED in case of error
+     */
+    void* remap_region(void* addr, size_t old_length, size_t new_length, int flags);
+
     /**
      * Unmaps the region, returning it to the pool of available pages. Does not return to the OS. Same as munmap()
      * syscall
@@ -52,6 +124,195 @@ extern "C"
      */
     int unmap_region(void* addr, size_t length);
 
+    /**
+     * One element of a batched request, see map_regions() and unmap_regions()
+     */
+    struct pk_region
+    {
+        void* addr;           /// start of the region. Written by map_regions()
+        size_t length;        /// size of the region in bytes
+        int err;              /// 0 if this element succeeded, otherwise the errno value describing the failure
+    };
+
+    /**
+     * Maps several regions at once, with the given protections. Cheaper than calling map_region() for each: the
+     * allocator's lock is taken once for the batch, and adjacent regions share their syscalls
+     * @param regions the requests. Set the length of each; the address and error of each are filled in, and a failed
+     * element has its address set to MAP_FAILED
+     * @param count number of elements in regions
+     * @param prot Requested page protections (see mmap(2))
+     * @return the number of regions that were mapped
+     */
+    size_t map_regions(struct pk_region* regions, size_t count, int prot);
+
+    /**
+     * Unmaps several regions at once, returning them to the pool of available pages. The regions are sorted by
+     * address, so adjacent regions are scrubbed with a single syscall, and each lock is taken once per run of regions
+     * @param regions the regions to unmap. The error of each is filled in; invalid or overlapping regions fail with
+     * EINVAL
+     * @param count number of elements in regions
+     * @return the number of regions that were unmapped
+     */
+    size_t unmap_regions(struct pk_region* regions, size_t count);
+
+    /**
+     * Starts recording every successful map and unmap of the default domain to a compact binary trace, which
+     * tools/trace_replay can replay offline. Setting PKALLOC_TRACE=path starts a trace when the domain is reserved.
+     * The trace stops at exit
+     * @param path the trace file, replaced if it exists
+     * @return 0 on success, or -1 with errno set: EBUSY if a trace is already running
+     */
+    int pk_trace_start(const char* path);
+
+    /**
+     * Writes out any buffered records and closes the trace
+     */
+    void pk_trace_stop();
+
+    /**
+     * Returns the extents held in every thread's cache of recently unmapped regions to the pool of available pages.
+     * Thread caches are also flushed automatically when their thread exits.
+     */
+    void drain_thread_caches();
+
+    /**
+     * A snapshot of the allocator's usage, see pk_stats()
+     */
+    struct pk_alloc_stats
+    {
+        size_t reserved;            /// bytes reserved for trusted mappings
+        size_t mapped;              /// bytes currently handed out by map_region
+        size_t free;                /// bytes available for new mappings
+        size_t cached;              /// bytes held in thread caches, neither mapped nor free
+        size_t ready;               /// bytes held in the ready pool, neither mapped nor free
+        size_t extents;             /// number of free extents
+        size_t largest_free;        /// size of the largest free extent in bytes
+        size_t dirty;               /// free bytes that have not been purged yet, see pk_set_purge_decay()
+        size_t purged;              /// total bytes purged in the background
+        uint64_t ready_hits;        /// map_region calls served by the ready pool
+        uint64_t ready_misses;      /// map_region calls of a pooled size that found the ready pool empty
+        uint64_t map_calls;         /// number of calls to map_region
+        uint64_t unmap_calls;       /// number of calls to unmap_region
+    };
+
+    /**
+     * Reports the allocator's usage. Every counter is maintained incrementally, and locks are only held long enough
+     * to read them, so this is cheap enough to poll regularly
+     * @param stats filled in with the current usage
+     */
+    void pk_stats(struct pk_alloc_stats* stats);
+
+    /**
+     * Maps a region from the share of the default domain bound to the given NUMA node. With NUMA placement enabled,
+     * map_region() already serves each thread from its own node; this overrides that choice
+     * @param node the NUMA node id
+     * @param length size of the region in bytes
+     * @param prot requested page protections
+     * @return the start of the region, or MAP_FAILED with errno set: EINVAL if NUMA placement is disabled or the
+     * reservation has no share on that node, ENOMEM if the node's share is full
+     */
+    void* map_region_on_node(int node, size_t length, int prot);
+
+    /**
+     * Usage of one NUMA node's share of the default domain, see pk_numa_stats()
+     */
+    struct pk_node_stats
+    {
+        int node;               /// the NUMA node id
+        size_t reserved;        /// bytes of the reservation bound to the node
+        size_t mapped;          /// bytes handed out from the node's share, including those held in caches
+        size_t misses;          /// requests from threads on the node that were served by another node
+    };
+
+    /**
+     * Reports the usage of each NUMA node's share of the default domain
+     * @param stats filled in for the first count nodes
+     * @param count size of stats
+     * @return the number of nodes the reservation is split across, or 0 if NUMA placement is disabled
+     */
+    size_t pk_numa_stats(struct pk_node_stats* stats, size_t count);
+
+    /**
+     * Chooses when unmapped pages are given back to the OS. With a decay of 0, the default, unmap_region() replaces
+     * the pages with fresh zero pages before returning. Otherwise unmap_region() only revokes access, and a background
+     * thread purges the dirty pages gradually, so each is purged within decay_ms of being unmapped. In this mode a
+     * region mapped over dirty pages is not guaranteed to be zeroed
+     * @param decay_ms time in milliseconds until an unmapped page is purged, or 0 to purge on unmap
+     */
+    void pk_set_purge_decay(long decay_ms);
+
+    /**
+     * Configures the ready pool: regions of a few common sizes kept mapped PROT_READ | PROT_WRITE ahead of time, so
+     * that map_region() can serve them without a syscall. A background thread tops a size up whenever it falls below
+     * low_water regions. Must not be called while other threads are mapping regions
+     * @param sizes region sizes to keep ready, in bytes. At most 8
+     * @param count number of sizes. 0 disables the pool, which is the default
+     * @param depth number of regions to keep of each size
+     * @param low_water refill a size once it has fewer than this many regions, between 1 and depth
+     * @param prefault if non zero, touch every page of a region before pooling it
+     * @return 0 on success or -1 if the configuration is invalid
+     */
+    int pk_ready_pool_configure(const size_t* sizes, size_t count, size_t depth, size_t low_water, int prefault);
+
+    /**
+     * jemalloc extent hooks that place a jemalloc arena's extents in the trusted region, e.g.
+     *     mallctl("arena.0.extent_hooks", NULL, NULL, &hooks, sizeof(hooks));
+     * Extents are committed PROT_READ | PROT_WRITE. Splitting and merging extents never touches the region
+     * @return the hooks, a jemalloc 5 extent_hooks_t
+     */
+    struct extent_hooks_s* pk_extent_hooks();
+
+    /**
+     * An isolated protection domain: a reserved region with its own pkey, freelists and locks. The default domain
+     * backs map_region(); others are made with pk_domain_create(). Domains are never destroyed
+     */
+    struct pk_domain;
+
+    /**
+     * Reserves a new domain
+     * @param size size of the domain's region in bytes, or 0 for the default of 1 TiB
+     * @return the domain, or NULL with errno set: EINVAL for a size larger than the default domain, ENOSPC once
+     * every pkey is in use, ENOMEM if the region cannot be reserved
+     */
+    struct pk_domain* pk_domain_create(size_t size);
+
+    /**
+     * @return the domain backing map_region()
+     */
+    struct pk_domain* pk_default_domain();
+
+    /**
+     * Finds the domain an address belongs to, in constant time
+     * @param addr The pointer to check
+     * @return the domain whose region contains addr, or NULL if there is none
+     */
+    struct pk_domain* domain_of(const void* addr);
+
+    /**
+     * @return the pkey protecting the domain's pages
+     */
+    int pk_domain_pkey(struct pk_domain* domain);
+
+    /**
+     * map_region(), in the given domain. The call enters the domain's gate while it updates the domain, so any thread
+     * may call it, including threads that were running before the domain was created. Those threads reach the pages it
+     * returns through enter_domain()
+     */
+    void* map_region_in(struct pk_domain* domain, void* addr, size_t length, int prot, int flags, int fd,
+                        ptrdiff_t offset);
+
+    /**
+     * unmap_region(), in the given domain, entering the domain's gate like map_region_in()
+     * @return 0 on success, -1 with errno set to EINVAL if the region does not belong to the domain
+     */
+    int unmap_region_in(struct pk_domain* domain, void* addr, size_t length);
+
+    /**
+     * Enters a gate into the given domain: its pages become accessible until the matching exit_domain()
+     */
+    void enter_domain(struct pk_domain* domain);
+    void exit_domain();
+
     /**
      * Get the value of the pkey used for the trusted region/vma
      * @return The value of the pkey used when mapping trusted pages
@@ -66,8 +327,116 @@ extern "C"
      */
     bool is_safe_address(void* addr);
 
+    /**
+     * Bounds of the trusted region, [start, start + size). Both are 0 until the region has been reserved. The region
+     * may be reserved while other threads read the bounds, so start is published first and size last, with release
+     * order: read size with acquire order before start, and a nonzero size guarantees start is set
+     */
+    struct pk_safe_bounds
+    {
+        uintptr_t start;
+        uintptr_t size;
+    };
+
+    extern struct pk_safe_bounds pk_bounds;
+
+    /**
+     * Inline version of is_safe_address(), for hot paths that cannot afford a call
+     * @param addr The pointer to check
+     * @return nonzero if the pointer's address falls within the reserved region
+     */
+    static inline int pk_is_safe_address(const void* addr)
+    {
+        uintptr_t size = __atomic_load_n(&pk_bounds.size, __ATOMIC_ACQUIRE);
+        return (uintptr_t)addr - __atomic_load_n(&pk_bounds.start, __ATOMIC_RELAXED) < size;
+    }
+
+    /**
+     * Checks if a whole range belongs to the trusted region
+     * @param addr start of the range
+     * @param length size of the range in bytes
+     * @return true if [addr, addr + length) lies within the reserved region. Empty ranges are never safe
+     */
+    bool is_safe_range(void* addr, size_t length);
+
+    /**
+     * Checks many pointers at once, using AVX-512 or AVX2 when the CPU has them
+     * @param ptrs the pointers to check
+     * @param count number of pointers
+     * @param out out[i] is set to 1 if ptrs[i] falls within the reserved region, and to 0 otherwise
+     * @return the number of pointers within the reserved region
+     */
+    size_t classify_pointers(const void** ptrs, size_t count, uint8_t* out);
+
+    /**
+     * Counts a gate pass. Counters are kept per thread, so this never contends with other threads
+     */
     void inc_gate_count();
 
+    /**
+     * @return the number of gate passes made by all threads
+     */
+    uint64_t pk_gate_count();
+
+    /**
+     * Call gates: grant the calling thread access to the trusted region until the matching exit_trusted(). Gates nest
+     * per thread, and each exit restores the exact PKRU value in effect before its enter. A gate that does not change
+     * the thread's rights, e.g. a nested enter_trusted(), skips the PKRU write. On hosts without protection keys the
+     * gates still nest, but never touch PKRU. Each enter_trusted() is counted as a gate pass
+     */
+    void enter_trusted();
+    void exit_trusted();
+
+    /**
+     * Revoke the calling thread's access to the trusted region until the matching exit_untrusted(), e.g. around a
+     * callback from trusted code into untrusted code. Nests with enter_trusted()
+     */
+    void enter_untrusted();
+    void exit_untrusted();
+
+    /**
+     * @return the number of gates the calling thread is currently inside
+     */
+    unsigned int gate_depth();
+
+/// number of buckets in a gate site's histogram
+#define PK_GATE_BUCKETS 32
+
+    /**
+     * A gate site, to find the gates that dominate switching overhead. While profiling is enabled, the gates below
+     * record the cycles spent switching PKRU in the histogram of their site. Define each site once, with static
+     * storage duration, using PK_GATE_SITE
+     */
+    struct pk_gate_site
+    {
+        const char* name;                            /// name of the site
+        uint64_t buckets[PK_GATE_BUCKETS];           /// buckets[i] counts switches taking [2^i, 2^(i+1)) cycles
+        struct pk_gate_site* next;                   /// next registered site, see pk_gate_sites()
+        int registered;
+    };
+
+/// defines a gate site named var
+#define PK_GATE_SITE(var) static struct pk_gate_site var = {#var}
+
+    /**
+     * The same as enter_trusted(), exit_trusted(), enter_untrusted() and exit_untrusted(), timed into site
+     */
+    void enter_trusted_at(struct pk_gate_site* site);
+    void exit_trusted_at(struct pk_gate_site* site);
+    void enter_untrusted_at(struct pk_gate_site* site);
+    void exit_untrusted_at(struct pk_gate_site* site);
+
+    /**
+     * Enables or disables recording into gate site histograms. Disabled by default
+     */
+    void pk_gate_profile(int enable);
+
+    /**
+     * @return the most recently registered gate site, or NULL. Sites are registered the first time they record a
+     * switch; follow pk_gate_site::next for the others
+     */
+    struct pk_gate_site* pk_gate_sites();
+
     static void __attribute__((constructor)) register_term_handler();
 
 #ifdef __cplusplus
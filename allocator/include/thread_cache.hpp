@@ -0,0 +1,130 @@
+// thread_cache.hpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef ALLOCATOR_THREAD_CACHE_HPP
+#define ALLOCATOR_THREAD_CACHE_HPP
+
+#include "vma.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace alloc
+{
+    /**
+     * Usage of all thread caches, including those of threads that have exited
+     */
+    struct cache_stats
+    {
+        size_t cached;              // bytes held in thread caches
+        uint64_t map_calls;         // number of map requests made through the caches
+        uint64_t unmap_calls;       // number of unmap requests made through the caches
+    };
+
+    /**
+     * A per-thread cache of recently unmapped extents, bucketed by page count.
+     *
+     * Extents in the cache have already been scrubbed and set to PROT_NONE, so a cache hit only needs to restore the
+     * requested protections. The vma is not touched on a hit.
+     */
+    class thread_cache
+    {
+    public:
+        static constexpr size_t max_pages   = 32;        /// largest extent (in pages) kept in the cache
+        static constexpr size_t bucket_size = 16;        /// max number of extents kept per page count
+
+        explicit thread_cache(vma* backing) noexcept;
+
+        /**
+         * Flushes all cached extents back to the vma, and removes the cache from the global registry
+         */
+        ~thread_cache() noexcept;
+
+        /**
+         * Maps a cached extent of the requested size
+         * @param length size of the request in bytes
+         * @param prot requested page protections
+         * @return the start of the extent, or nullptr if the cache cannot satisfy the request
+         */
+        void* map(size_t length, int prot) noexcept;
+
+        /**
+         * Scrubs the extent and places it in the cache
+         * @param addr start of the extent. Must be page aligned
+         * @param length size of the extent in bytes
+         * @return true if the extent was cached, false if the caller must return it to the vma
+         */
+        bool unmap(void* addr, size_t length) noexcept;
+
+        /**
+         * Returns every extent held by this cache to the vma
+         */
+        void flush() noexcept;
+
+        /**
+         * Flushes the caches of all live threads
+         */
+        static void drain_all() noexcept;
+
+        /**
+         * Counts map requests made by this thread, whether or not the cache served them
+         * @param count number of requests, more than one for a batch
+         */
+        void record_map(uint64_t count = 1) noexcept;
+
+        /**
+         * Counts unmap requests made by this thread, whether or not the cache served them
+         * @param count number of requests, more than one for a batch
+         */
+        void record_unmap(uint64_t count = 1) noexcept;
+
+        /**
+         * Sums the counters of every cache
+         * @param stats filled in with the totals
+         */
+        static void get_stats(cache_stats& stats) noexcept;
+
+    private:
+        struct bucket
+        {
+            size_t count;
+            void* extents[bucket_size];
+        };
+
+        vma* backing;                     // vma the cached extents belong to
+        std::mutex lock;                  // only contended when another thread drains this cache
+        bucket buckets[max_pages];        // buckets[i] holds extents of (i + 1) pages
+        thread_cache* prev;               // links for the registry of live caches
+        thread_cache* next;
+
+        // read by get_stats() from any thread without taking the cache lock
+        std::atomic<size_t> cached_bytes;
+        std::atomic<uint64_t> map_calls;
+        std::atomic<uint64_t> unmap_calls;
+
+        static size_t page_count(size_t length) noexcept;
+    };
+}        // namespace alloc
+
+#endif        // ALLOCATOR_THREAD_CACHE_HPP
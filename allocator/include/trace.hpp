@@ -0,0 +1,124 @@
+// trace.hpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#ifndef ALLOCATOR_TRACE_HPP
+#define ALLOCATOR_TRACE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace alloc
+{
+    /**
+     * Opt-in binary trace of the map and unmap calls made through the C API, for replaying real workloads offline.
+     *
+     * A trace file is a header followed by fixed size records in the order they were flushed. Each thread fills a
+     * buffer of its own and appends it to the file when the buffer is full, when the thread exits and when the trace
+     * stops, so records of different threads are interleaved in batches; sort them by time to recover the global
+     * order. While tracing is off, an event costs a single relaxed load.
+     */
+    namespace trace
+    {
+        constexpr char magic[8]         = {'P', 'K', 'T', 'R', 'A', 'C', 'E', '\0'};
+        constexpr uint32_t version      = 1;
+        constexpr size_t buffer_records = 1024;        /// records each thread buffers before writing them out
+
+        enum op : uint8_t
+        {
+            op_map   = 1,
+            op_unmap = 2,
+        };
+
+        struct header
+        {
+            char magic[8];
+            uint32_t version;
+            uint32_t record_size;        // sizeof(record), so readers can detect a mismatched layout
+        };
+
+        struct record
+        {
+            uint64_t time_ns;        // time since the trace started
+            uint64_t addr;           // start of the region
+            uint64_t length;         // size of the region in bytes, as passed by the caller
+            uint32_t thread;         // small id of the calling thread, assigned in order of each thread's first event
+            uint8_t op;              // op_map or op_unmap
+            uint8_t prot;            // protections of a mapping, 0 for an unmapping
+            uint16_t reserved;
+        };
+
+        static_assert(sizeof(record) == 32, "trace records must stay compact");
+
+        inline std::atomic<bool> enabled(false);
+
+        /**
+         * Starts writing a new trace, replacing any file at path
+         * @param path the trace file
+         * @return false with errno set if the file could not be created, or EBUSY if a trace is already running
+         */
+        bool start(const char* path) noexcept;
+
+        /**
+         * Flushes every thread's buffer and closes the trace. Does nothing if no trace is running
+         */
+        void stop() noexcept;
+
+        /**
+         * @return nanoseconds since the trace started
+         */
+        uint64_t elapsed() noexcept;
+
+        /**
+         * Appends a record to the calling thread's buffer. Use event() instead, which skips the call while tracing is
+         * off
+         * @param time when the call happened, see elapsed()
+         */
+        void log(op kind, const void* addr, size_t length, int prot, uint64_t time) noexcept;
+
+        /**
+         * Reads the clock for an event that must be stamped before the call it records, so that an unmap always sorts
+         * before another thread's map of the same pages
+         * @return the current time, or 0 while tracing is off
+         */
+        [[gnu::always_inline]] inline uint64_t now() noexcept
+        {
+            return enabled.load(std::memory_order_relaxed) ? elapsed() : 0;
+        }
+
+        /**
+         * Records a call if tracing is on
+         * @param time when the call happened, from now(), or 0 for the current time
+         */
+        [[gnu::always_inline]] inline void event(op kind, const void* addr, size_t length, int prot,
+                                                 uint64_t time = 0) noexcept
+        {
+            if(enabled.load(std::memory_order_relaxed))
+            {
+                log(kind, addr, length, prot, time != 0 ? time : elapsed());
+            }
+        }
+    }        // namespace trace
+}        // namespace alloc
+
+#endif        // ALLOCATOR_TRACE_HPP
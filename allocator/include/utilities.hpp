@@ -40,6 +40,12 @@ namespace alloc
         extern const int default_fd;                  /// default file descriptor: -1
         extern const ptrdiff_t default_offset;        /// default file offset: 0
         extern const size_t default_size;             /// default size of protected region
+        extern const size_t default_domain_size;      /// default size of each additional domain: 1 TiB
+        extern const size_t default_shards;           /// default number of vma shards: 0 (one per CPU)
+        extern const size_t shard_granule;            /// unit of memory shards claim and steal: 1 GiB
+        extern const size_t metadata_size;            /// space reserved for each freelist's nodes: 64 MiB
+        extern const long default_decay_ms;           /// default purge decay: 0 (discard pages on unmap)
+        extern const size_t decay_steps;              /// purger passes per decay period: 20
 
         /**
          * Calculate the aligned size
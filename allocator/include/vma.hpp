@@ -26,29 +26,388 @@
 #include "freelist.hpp"
 #include "mpk.h"
 
+#include <atomic>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <sys/mman.h>
+#include <thread>
+#include <vector>
 
 namespace alloc
 {
+    /**
+     * A snapshot of a vma's usage
+     */
+    struct vma_stats
+    {
+        size_t reserved;            // size of the data region in bytes
+        size_t free;                // bytes available for new mappings
+        size_t extents;             // number of free extents
+        size_t largest_free;        // size of the largest free extent in bytes
+        size_t dirty;               // bytes unmapped but not yet purged, part of free
+        size_t purged;              // total bytes purged by the background purger
+    };
+
+    /**
+     * Usage of one NUMA node's share of a vma, see vma::get_node_stats()
+     */
+    struct node_stats
+    {
+        int node;               // the NUMA node id
+        size_t reserved;        // bytes of the region bound to the node
+        size_t mapped;          // bytes currently handed out from the node's share
+        size_t misses;          // requests from threads on the node that had to be served by another node
+    };
+
+    /**
+     * One element of a batched map or unmap request
+     */
+    struct region_request
+    {
+        void* addr;            // start of the region, filled in by map_regions()
+        size_t length;         // size of the region in bytes
+        int err;               // 0 on success, otherwise the errno value describing why this element failed
+    };
+
+    /**
+     * The protected region, split into shards that each manage their memory with their own freelist and lock.
+     *
+     * The region is divided into granules. Each granule is owned by either the shared pool or one shard, and every
+     * free extent lies in granules owned by the list that tracks it, so freed memory always finds its way back to the
+     * owner. Requests of at least one granule are served from the pool. Smaller requests are served by the calling
+     * CPU's home shard, which claims granules from the pool as it needs them, and steals free granules from its
+     * neighbors once the pool runs dry.
+     *
+     * With NUMA placement, the region is split into one share per NUMA node, each bound to its node with mbind() and
+     * backing a pool of its own. Requests are served from the calling thread's node, and shards claim granules from
+     * the pool of the node they run on, so a node's share only spills onto others once it is full.
+     *
+     * map_region() also maps files and shared memory, such as a memfd shared with other processes, in place of the
+     * reserved pages. Such backed regions are recorded, so unmapping them puts fresh reserved pages back at once.
+     *
+     * map_region() honors MAP_POPULATE, faulting the region in before returning it, or with MAP_NONBLOCK as well,
+     * leaving that to a background thread.
+     *
+     * By default unmapped pages are discarded immediately. With a purge decay set, unmapping only revokes access,
+     * and a background thread gives the dirty pages back to the OS as they age.
+     */
     class vma
     {
     public:
+        static constexpr int map_hugepage  = 0x1;        /// aligned_map_region() flag: back the region with huge pages
+        static constexpr int map_populate  = 0x2;        /// aligned_map_region() flag: fault the region in up front
+        static constexpr int remap_maymove = 0x1;        /// remap_region() flag: the region may be moved to grow it
+        static constexpr size_t max_nodes  = 64;         /// NUMA placement supports node ids below this
+
         vma() noexcept;
+        explicit vma(size_t shard_count) noexcept;
+
+        /**
+         * Reserves a protected region of the given size, under a pkey of its own
+         * @param shard_count number of shards, 0 for one per CPU
+         * @param reserve size of the region in bytes, a multiple of the page size
+         */
+        vma(size_t shard_count, size_t reserve) noexcept;
+
+        /**
+         * Reserves a protected region of the given size and alignment
+         * @param shard_count number of shards, 0 for one per CPU
+         * @param reserve size of the region in bytes, a multiple of the page size
+         * @param alignment alignment of the start of the region, a power of two. Anything below a granule, including
+         * 0, aligns the region to a granule
+         * @param rights access rights of the calling thread to the region's pkey once it has been set up, e.g.
+         * PKEY_DISABLE_ACCESS
+         * @param key a pkey allocated by the caller, which the vma takes over, or -1 to allocate one. Threads only
+         * inherit access to a pkey from the thread that spawns them, so allocating the key early lets the region be
+         * reserved lazily without locking out threads spawned in the meantime
+         */
+        vma(size_t shard_count, size_t reserve, size_t alignment, unsigned int rights, int key) noexcept;
+
+        /**
+         * Reserves a protected region, optionally split across the NUMA nodes the process may allocate from
+         * @param numa if true, bind an equal share of the region to each node, see map_region_on_node(). Ignored if
+         * the kernel does not report the nodes
+         */
+        vma(size_t shard_count, size_t reserve, size_t alignment, unsigned int rights, int key, bool numa) noexcept;
+
+        /**
+         * Reserves a protected region like the constructor above, but reports failure instead of exiting: if the
+         * region cannot be reserved, reserved() is false, errno is set and the vma may only be destroyed. The key, if
+         * one was given, stays with the caller in that case
+         */
+        vma(std::nothrow_t, size_t shard_count, size_t reserve, size_t alignment, unsigned int rights, int key,
+            bool numa) noexcept;
         ~vma() noexcept;
+
+        /**
+         * @return true unless the region could not be reserved
+         */
+        bool reserved() const noexcept;
         void* map_region(void* addr, size_t length, int prot, int flags, int fd, ptrdiff_t offset) noexcept;
         int unmap_region(void* addr, size_t length) noexcept;
+
+        /**
+         * Maps a region aligned to any power of two. The region is carved directly from an extent large enough to
+         * hold it at that alignment, so nothing is over-allocated or trimmed
+         * @param length size of the region in bytes
+         * @param alignment required alignment of the start of the region, a power of two. Alignments below a page are
+         * rounded up to a page
+         * @param prot requested page protections
+         * @param flags map_hugepage, which asks the kernel to back the region with transparent huge pages, and
+         * map_populate, which faults the region in before returning it
+         * @return the start of the region, or MAP_FAILED with errno set
+         */
+        void* aligned_map_region(size_t length, size_t alignment, int prot, int flags) noexcept;
+
+        /**
+         * Resizes a mapped region, keeping its contents and protections, like mremap().
+         *
+         * A region shrinks in place by unmapping its tail. It grows in place when the pages after it are free in the
+         * list that owns it. Otherwise, if allowed, it is moved: the kernel moves the page tables, so nothing is
+         * copied. The reservation never has a hole meanwhile, but the region's first page is briefly moved away, so
+         * the region must not be in use by other threads. A region backed by a file or shared memory can only shrink
+         * @param addr start of the region
+         * @param old_length current size of the region in bytes
+         * @param new_length requested size of the region in bytes
+         * @param flags 0 or remap_maymove
+         * @return the start of the resized region, or MAP_FAILED with errno set, in which case the region is unchanged
+         */
+        void* remap_region(void* addr, size_t old_length, size_t new_length, int flags) noexcept;
         int get_pkey() noexcept;
+
+        /**
+         * @return true if part of [addr, addr + length) is mapped from a file or shared memory, by map_region() with
+         * MAP_SHARED or a file descriptor, rather than backed by the reservation's own pages
+         */
+        bool is_backed(void* addr, size_t length) noexcept;
+
+        /**
+         * Faults in the pages of a mapped region, so that touching them later takes no page faults. Uses
+         * MADV_POPULATE_WRITE, or MADV_POPULATE_READ for read only regions, and falls back to touching every page on
+         * kernels without them. Like touching the pages, this needs access to the pkey
+         * @param addr start of the region
+         * @param length size of the region in bytes
+         * @param prot the region's protections. PROT_NONE regions are left alone
+         * @param background if true, queue the region for a background thread and return at once. A region unmapped
+         * before its turn comes is skipped by the kernel. Without the madvise() calls the work is done inline
+         */
+        void populate(void* addr, size_t length, int prot, bool background) noexcept;
+
+        /**
+         * Maps a region from the share of the given NUMA node, whichever node the calling thread runs on
+         * @param node the NUMA node id
+         * @param length size of the region in bytes
+         * @param prot requested page protections
+         * @return the start of the region, or MAP_FAILED with errno set: EINVAL if the region has no share on that
+         * node, ENOMEM if the node's share is full
+         */
+        void* map_region_on_node(int node, size_t length, int prot) noexcept;
+
+        /**
+         * @return the number of NUMA nodes the region is split across, 1 without NUMA placement
+         */
+        size_t numa_nodes() const noexcept;
+
+        /**
+         * Reads the usage counters of each node's share. The counters are only kept with NUMA placement
+         * @param stats filled in for the first count nodes
+         * @param count size of stats
+         * @return the number of nodes the region is split across, or 0 without NUMA placement
+         */
+        size_t get_node_stats(node_stats* stats, size_t count) noexcept;
+
+        /**
+         * @return true if addr lies in the reserved range [region_start, region_end)
+         */
         bool is_safe_addr(void* addr) noexcept;
+
+        /**
+         * @return true if all of [addr, addr + length) lies in the reserved range. Empty ranges are never safe
+         */
+        bool is_safe_range(void* addr, size_t length) noexcept;
+
+        /**
+         * Checks many addresses against the reserved range, using the widest vector unit the CPU has
+         * @param ptrs the addresses to check
+         * @param count number of addresses
+         * @param out out[i] is set to 1 if ptrs[i] is safe, and to 0 otherwise
+         * @return the number of safe addresses
+         */
+        size_t classify_pointers(const void* const* ptrs, size_t count, uint8_t* out) noexcept;
+
+        /**
+         * Bounds of the reserved range, for callers that inline their own checks
+         */
+        uintptr_t safe_begin() const noexcept;
+        uintptr_t safe_end() const noexcept;
         void print_mem() noexcept;
 
+        /**
+         * Collects the usage of every shard. Each shard's lock is only held long enough to read its counters
+         * @param stats filled in with the current usage
+         */
+        void get_stats(vma_stats& stats) noexcept;
+
+        /**
+         * Maps a batch of regions. Small requests are carved from the home shard under a single lock acquisition, and
+         * regions that end up adjacent are given their protections with a single call
+         * @param regions the requests. The length of each is read, and the address and error of each are written;
+         * a failed element has its address set to MAP_FAILED
+         * @param count number of requests
+         * @param prot requested page protections for every region
+         * @return the number of regions that were mapped
+         */
+        size_t map_regions(region_request* regions, size_t count, int prot) noexcept;
+
+        /**
+         * Unmaps a batch of regions. The regions are sorted by address, adjacent regions are scrubbed with a single
+         * call, and each owner's lock is taken once for every run of its regions
+         * @param regions the regions to unmap. The error of each is written
+         * @param count number of regions
+         * @return the number of regions that were unmapped
+         */
+        size_t unmap_regions(region_request* regions, size_t count) noexcept;
+
+        /**
+         * Chooses when unmapped pages are given back to the OS.
+         *
+         * With a decay of 0, the default, pages are replaced with fresh zero pages as they are unmapped. Otherwise
+         * unmapping only sets the pages to PROT_NONE, and a background thread purges them along a smoothstep curve,
+         * so that every page is purged by the time it has been free for the whole decay. Pages reused before they are
+         * purged keep their old contents.
+         * @param decay time until an unmapped page must be purged, or 0 to purge on unmap
+         */
+        void set_purge_decay(std::chrono::milliseconds decay) noexcept;
+
+        /**
+         * Purges every dirty page now
+         */
+        void purge_all() noexcept;
+
+        /**
+         * @return true if unmapped pages are purged in the background, so newly mapped pages may not be zero
+         */
+        bool defers_purging() noexcept;
+
+        /**
+         * Checks if two mapped addresses belong to the same list. A region may only span addresses of one list, as it
+         * is returned to a single list when it is unmapped
+         */
+        bool same_owner(void* lhs, void* rhs) noexcept;
+
     private:
+        static constexpr uint16_t pool_owner = UINT16_MAX;        // owner id of granules held by the pool
+
+        struct alignas(64) shard
+        {
+            std::mutex lock;
+            freelist list;
+            size_t granules;        // number of granules owned by this list
+        };
+
+        struct alignas(64) node_usage
+        {
+            std::atomic<size_t> mapped;
+            std::atomic<size_t> misses;
+        };
+
+        struct populate_request
+        {
+            void* addr;
+            size_t length;
+            int prot;
+        };
+
+        struct dirty_extent
+        {
+            char* addr;
+            size_t length;
+            std::chrono::steady_clock::time_point freed;
+        };
+
         void* region_start;
         void* region_end;
         ptrdiff_t size;
-        freelist list;
         int pkey;
+        size_t granule;                                        // size of a granule, a power of two
+        size_t shard_count;
+        std::unique_ptr<shard[]> shards;                       // shards[shard_count + n] is the pool of node n
+        std::unique_ptr<std::atomic<uint16_t>[]> owners;        // owner of each granule
+
+        // NUMA placement. Node n's share starts at region_start + n * node_span; the last share takes the remainder
+        bool numa;
+        size_t node_count;
+        size_t node_span;                                  // a multiple of the granule size
+        int node_ids[max_nodes];                           // NUMA node id of each share
+        int8_t node_index[max_nodes];                      // share of each NUMA node id, or -1
+        std::unique_ptr<node_usage[]> usage;
+
+        // deferred purging. The queue holds unmapped extents oldest first; an extent may have been reused since
+        std::atomic<long> decay_ms;
+        std::mutex purge_lock;
+        std::condition_variable purge_wake;
+        std::deque<dirty_extent> dirty;
+        std::thread purger;
+        bool stop_purger;
+        std::atomic<size_t> dirty_bytes;
+        std::atomic<size_t> purged_bytes;
+
+        // regions mapped from a file or shared memory, by start and end. backed_count is the size of backed, so that
+        // the common case of no backed regions is checked without taking the lock
+        std::mutex backed_lock;
+        std::map<char*, char*> backed;
+        std::atomic<size_t> backed_count;
+
+        // background populating, started by the first request for it
+        std::mutex populate_lock;
+        std::condition_variable populate_wake;
+        std::deque<populate_request> to_populate;
+        std::thread populater;
+        bool stop_populater;
+
+        size_t granule_index(void* addr) noexcept;
+        size_t owner_of(void* addr) noexcept;
+        size_t home_shard() noexcept;
+        size_t pool_of(size_t node) const noexcept;
+        size_t node_of(void* addr) const noexcept;
+        size_t local_node() const noexcept;
+        char* share_end(char* addr, char* end) const noexcept;
+        bool bind_pages(void* addr, size_t length) noexcept;
+        void track(void* addr, size_t length, bool mapped) noexcept;
+        void* pool_request(size_t node, size_t length, size_t align) noexcept;
+        void* allocate(size_t length, size_t align = utils::default_alignment) noexcept;
+        void return_pages(void* addr, size_t length) noexcept;
+        bool grow_in_place(char* addr, size_t old_length, size_t new_length) noexcept;
+        void* move_region(char* addr, size_t old_length, size_t new_length) noexcept;
+        bool copy_mapping(void* from, size_t length, void* to) noexcept;
+        bool clone_mapping(char* from, size_t from_length, char* to, size_t length) noexcept;
+        bool move_back(char* from, char* to, size_t length) noexcept;
+        bool reset_pages(void* addr, size_t length) noexcept;
+        void* shard_request(size_t idx, void* addr, size_t length,
+                            size_t align = utils::default_alignment) noexcept;
+        void* shard_request_granule(size_t idx) noexcept;
+        bool claim_granule(size_t idx, size_t node) noexcept;
+        bool reclaim_granules() noexcept;
+        void release_granules(size_t idx, void* addr, size_t length) noexcept;
+        bool decommit(void* addr, size_t length, bool& deferred, int& err) noexcept;
+        bool attach(void* addr, size_t length, int prot, int flags, int fd, ptrdiff_t offset) noexcept;
+        void add_backed(void* addr, size_t length) noexcept;
+        void forget_backed(void* addr, size_t length) noexcept;
+        void queue_dirty(void* addr, size_t length) noexcept;
+        void purge_loop() noexcept;
+        void purge_extent(char* addr, size_t length) noexcept;
+        void stop_purging() noexcept;
+        void populate_now(void* addr, size_t length, int prot) noexcept;
+        void populate_loop() noexcept;
+        void stop_populating() noexcept;
     };
 
 }        // namespace alloc
@@ -0,0 +1,118 @@
+// classify.cpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <classify.hpp>
+
+#include <cstring>
+#include <immintrin.h>
+
+namespace alloc
+{
+    namespace classify
+    {
+        size_t pointers_scalar(uintptr_t start, uintptr_t end, const void* const* ptrs, size_t n, uint8_t* out) noexcept
+        {
+            size_t count = 0;
+            for(size_t i = 0; i < n; ++i)
+            {
+                out[i] = contains(start, end, ptrs[i]) ? 1 : 0;
+                count += out[i];
+            }
+            return count;
+        }
+
+        __attribute__((target("avx2,bmi2"))) size_t pointers_avx2(uintptr_t start, uintptr_t end,
+                                                                  const void* const* ptrs, size_t n,
+                                                                  uint8_t* out) noexcept
+        {
+            // AVX2 only compares signed 64 bit lanes, so flip the sign bits to compare as unsigned
+            const auto sign  = _mm256_set1_epi64x(INT64_MIN);
+            const auto base  = _mm256_set1_epi64x(static_cast<int64_t>(start));
+            const auto limit = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<int64_t>(end - start)), sign);
+
+            size_t count = 0;
+            size_t i     = 0;
+            for(; i + 4 <= n; i += 4)
+            {
+                auto p      = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptrs + i));
+                auto offset = _mm256_xor_si256(_mm256_sub_epi64(p, base), sign);
+                auto inside = _mm256_cmpgt_epi64(limit, offset);
+                auto mask   = static_cast<unsigned int>(_mm256_movemask_pd(_mm256_castsi256_pd(inside)));
+
+                // spread the four mask bits into four bytes
+                uint32_t bytes = _pdep_u32(mask, 0x01010101U);
+                memcpy(out + i, &bytes, sizeof(bytes));
+                count += static_cast<size_t>(__builtin_popcount(mask));
+            }
+            return count + pointers_scalar(start, end, ptrs + i, n - i, out + i);
+        }
+
+        __attribute__((target("avx512f,avx512bw,avx512vl"))) size_t pointers_avx512(uintptr_t start, uintptr_t end,
+                                                                                     const void* const* ptrs, size_t n,
+                                                                                     uint8_t* out) noexcept
+        {
+            const auto base  = _mm512_set1_epi64(static_cast<int64_t>(start));
+            const auto limit = _mm512_set1_epi64(static_cast<int64_t>(end - start));
+            const auto ones  = _mm_set1_epi8(1);
+
+            size_t count = 0;
+            size_t i     = 0;
+            for(; i + 8 <= n; i += 8)
+            {
+                auto p    = _mm512_loadu_si512(ptrs + i);
+                auto mask = _mm512_cmplt_epu64_mask(_mm512_sub_epi64(p, base), limit);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i), _mm_maskz_mov_epi8(mask, ones));
+                count += static_cast<size_t>(__builtin_popcount(mask));
+            }
+
+            // finish the tail with a masked load
+            if(i < n)
+            {
+                auto tail = static_cast<__mmask8>((1U << (n - i)) - 1);
+                auto p    = _mm512_maskz_loadu_epi64(tail, ptrs + i);
+                auto mask = _mm512_mask_cmplt_epu64_mask(tail, _mm512_sub_epi64(p, base), limit);
+                _mm_mask_storeu_epi8(out + i, tail, _mm_maskz_mov_epi8(mask, ones));
+                count += static_cast<size_t>(__builtin_popcount(mask));
+            }
+            return count;
+        }
+
+        bool has_avx2() noexcept
+        {
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+        }
+
+        bool has_avx512() noexcept
+        {
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+                   __builtin_cpu_supports("avx512vl");
+        }
+
+        size_t pointers(uintptr_t start, uintptr_t end, const void* const* ptrs, size_t n, uint8_t* out) noexcept
+        {
+            using kernel         = size_t (*)(uintptr_t, uintptr_t, const void* const*, size_t, uint8_t*) noexcept;
+            static kernel chosen = has_avx512() ? pointers_avx512 : has_avx2() ? pointers_avx2 : pointers_scalar;
+            return chosen(start, end, ptrs, n, out);
+        }
+    }        // namespace classify
+}        // namespace alloc
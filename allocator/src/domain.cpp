@@ -0,0 +1,164 @@
+// domain.cpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <domain.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+namespace alloc
+{
+    namespace domain
+    {
+        namespace
+        {
+            constexpr unsigned int slot_shift = 30;                                // 1 GiB slots
+            constexpr size_t slot_count       = (1UL << 47U) >> slot_shift;        // covers the user address space
+
+            std::mutex registry_lock;                             // serializes registration; lookups never lock
+            std::atomic<vma*> domains[max_domains];
+            std::atomic<size_t> registered(0);
+            std::atomic<uint8_t> slots[slot_count];        // domain index + 1 owning each slot, 0 for none
+
+            vma* scan(const void* addr) noexcept
+            {
+                auto n = registered.load(std::memory_order_acquire);
+                for(size_t i = 0; i < n; ++i)
+                {
+                    auto d = domains[i].load(std::memory_order_acquire);
+                    if(d->is_safe_addr(const_cast<void*>(addr)))
+                    {
+                        return d;
+                    }
+                }
+                return nullptr;
+            }
+
+            // registers the domain with registry_lock held
+            bool add_locked(vma* backing) noexcept
+            {
+                auto index = registered.load(std::memory_order_relaxed);
+                if(index == max_domains)
+                {
+                    return false;
+                }
+                domains[index].store(backing, std::memory_order_release);
+                registered.store(index + 1, std::memory_order_release);
+
+                // claim the slots the reservation covers. A slot already claimed by a neighbor stays with it, and
+                // lookups that land there fall back to scanning
+                auto first = backing->safe_begin() >> slot_shift;
+                auto last  = std::min(slot_count, ((backing->safe_end() - 1) >> slot_shift) + 1);
+                for(auto slot = first; slot < last; ++slot)
+                {
+                    uint8_t none = 0;
+                    slots[slot].compare_exchange_strong(none, static_cast<uint8_t>(index + 1),
+                                                        std::memory_order_release, std::memory_order_relaxed);
+                }
+                return true;
+            }
+        }        // namespace
+
+        bool add(vma* backing) noexcept
+        {
+            std::lock_guard<std::mutex> registry_guard(registry_lock);
+            return add_locked(backing);
+        }
+
+        vma* create(size_t size) noexcept
+        {
+            if(size == 0)
+            {
+                size = utils::default_domain_size;
+            }
+            if(size > utils::default_size)
+            {
+                errno = EINVAL;
+                return nullptr;
+            }
+
+            // hold the registry for the whole creation, so that a full registry is seen before a pkey is spent on a
+            // domain that could not be registered
+            std::lock_guard<std::mutex> registry_guard(registry_lock);
+            if(registered.load(std::memory_order_relaxed) == max_domains)
+            {
+                errno = ENOSPC;
+                return nullptr;
+            }
+
+            // without a pkey of its own the domain would not be isolated, so the key is allocated before anything is
+            // reserved
+            auto key = pkey_alloc(0, 0);
+            if(key == -1)
+            {
+                errno = ENOSPC;
+                return nullptr;
+            }
+
+            auto reserve = utils::get_aligned_size(size, utils::min_alignment);
+            auto backing = new(std::nothrow) vma(std::nothrow, utils::default_shards, reserve, 0, 0, key, false);
+            if(!backing || !backing->reserved())
+            {
+                delete backing;
+                pkey_free(key);
+                errno = ENOMEM;
+                return nullptr;
+            }
+
+            // the registry was checked under the same lock, so there is room
+            add_locked(backing);
+            return backing;
+        }
+
+        vma* of(const void* addr) noexcept
+        {
+            auto slot = reinterpret_cast<uintptr_t>(addr) >> slot_shift;
+            if(slot >= slot_count)
+            {
+                return nullptr;
+            }
+
+            auto index = slots[slot].load(std::memory_order_acquire);
+            if(index == 0)
+            {
+                return nullptr;
+            }
+
+            auto d = domains[index - 1].load(std::memory_order_relaxed);
+            if(d->is_safe_addr(const_cast<void*>(addr)))
+            {
+                return d;
+            }
+            return scan(addr);
+        }
+
+        size_t count() noexcept
+        {
+            return registered.load(std::memory_order_acquire);
+        }
+    }        // namespace domain
+}        // namespace alloc
@@ -0,0 +1,130 @@
+// extent_hooks.cpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <extent_hooks.hpp>
+
+#include <cstring>
+#include <type_traits>
+
+namespace alloc
+{
+    static_assert(std::is_standard_layout<vma_extent_hooks>::value, "the hooks must sit at the adapter's address");
+
+    namespace
+    {
+        constexpr int extent_prot = PROT_READ | PROT_WRITE;
+
+        // jemalloc hooks return false on success
+
+        void* extent_alloc(extent_hooks_t* hooks, void* new_addr, size_t size, size_t alignment, bool* zero,
+                           bool* commit, unsigned /*arena_ind*/)
+        {
+            auto v    = vma_extent_hooks::backing_of(hooks);
+            auto addr = new_addr ? v->map_region(new_addr, size, extent_prot, utils::default_flags, utils::default_fd,
+                                                 utils::default_offset)
+                                 : v->aligned_map_region(size, alignment, extent_prot, 0);
+            if(addr == MAP_FAILED)
+            {
+                return nullptr;
+            }
+
+            if(new_addr && addr != new_addr)
+            {
+                v->unmap_region(addr, size);
+                return nullptr;
+            }
+
+            // pages are only guaranteed to be zero when they are scrubbed on unmap
+            if(*zero && v->defers_purging())
+            {
+                memset(addr, 0, size);
+            }
+            *zero   = *zero || !v->defers_purging();
+            *commit = true;
+            return addr;
+        }
+
+        bool extent_dalloc(extent_hooks_t* hooks, void* addr, size_t size, bool /*committed*/, unsigned /*arena_ind*/)
+        {
+            return vma_extent_hooks::backing_of(hooks)->unmap_region(addr, size) != 0;
+        }
+
+        void extent_destroy(extent_hooks_t* hooks, void* addr, size_t size, bool /*committed*/,
+                            unsigned /*arena_ind*/)
+        {
+            vma_extent_hooks::backing_of(hooks)->unmap_region(addr, size);
+        }
+
+        bool extent_commit(extent_hooks_t* hooks, void* addr, size_t /*size*/, size_t offset, size_t length,
+                           unsigned /*arena_ind*/)
+        {
+            auto pkey = vma_extent_hooks::backing_of(hooks)->get_pkey();
+            return pkey_mprotect(static_cast<char*>(addr) + offset, length, extent_prot, pkey) != 0;
+        }
+
+        bool extent_decommit(extent_hooks_t* hooks, void* addr, size_t /*size*/, size_t offset, size_t length,
+                             unsigned /*arena_ind*/)
+        {
+            auto pages = static_cast<char*>(addr) + offset;
+            auto pkey  = vma_extent_hooks::backing_of(hooks)->get_pkey();
+            return madvise(pages, length, MADV_DONTNEED) != 0 || pkey_mprotect(pages, length, PROT_NONE, pkey) != 0;
+        }
+
+        bool extent_purge_lazy(extent_hooks_t* /*hooks*/, void* addr, size_t /*size*/, size_t offset, size_t length,
+                               unsigned /*arena_ind*/)
+        {
+#ifdef MADV_FREE
+            return madvise(static_cast<char*>(addr) + offset, length, MADV_FREE) != 0;
+#else
+            return true;
+#endif
+        }
+
+        bool extent_purge_forced(extent_hooks_t* /*hooks*/, void* addr, size_t /*size*/, size_t offset,
+                                 size_t length, unsigned /*arena_ind*/)
+        {
+            return madvise(static_cast<char*>(addr) + offset, length, MADV_DONTNEED) != 0;
+        }
+
+        bool extent_split(extent_hooks_t* /*hooks*/, void* /*addr*/, size_t /*size*/, size_t /*size_a*/,
+                          size_t /*size_b*/, bool /*committed*/, unsigned /*arena_ind*/)
+        {
+            // mapped extents carry no metadata in the vma, so any piece can be unmapped on its own
+            return false;
+        }
+
+        bool extent_merge(extent_hooks_t* hooks, void* addr_a, size_t /*size_a*/, void* addr_b, size_t /*size_b*/,
+                          bool /*committed*/, unsigned /*arena_ind*/)
+        {
+            // a merged extent is returned to a single list when it is unmapped, so both halves must share it
+            return !vma_extent_hooks::backing_of(hooks)->same_owner(addr_a, addr_b);
+        }
+    }        // namespace
+
+    vma_extent_hooks::vma_extent_hooks(vma* backing) noexcept
+      : hooks{extent_alloc,      extent_dalloc,       extent_destroy, extent_commit, extent_decommit,
+              extent_purge_lazy, extent_purge_forced, extent_split,   extent_merge},
+        backing(backing)
+    {
+    }
+}        // namespace alloc
@@ -22,60 +22,76 @@
 
 #include <freelist.hpp>
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+
 namespace alloc
 {
 
-    freelist::freelist() = default;
+    freelist_base::freelist_base() = default;
 
-    freelist::freelist(void* start, void* end)
+    freelist_base::freelist_base(void* start, void* end)
     {
         init(start, end);
     }
 
-    freelist::~freelist() = default;
+    freelist_base::~freelist_base() = default;
 
-    void freelist::init(void* start, void* end)
+    void freelist_base::init(void* start, void* end)
     {
         // reserve first page of region for internal use
         auto new_start = static_cast<char*>(start) + utils::default_alignment;
+        init(start, utils::default_alignment, new_start, end);
+    }
 
-        // make a new node at the start of that page
-        list_ary = static_cast<freelist_node*>(start);
+    void freelist_base::init(void* meta, size_t meta_len, void* start, void* end)
+    {
+        // make a new node at the start of the metadata
+        list_ary = static_cast<freelist_node*>(meta);
 
         // initialize the arena and list
-        arena.init(start, utils::default_alignment);
-        init_list_head(new_start, end);
+        arena.init(meta, meta_len);
+        init_list_head(start, end);
     }
 
-    void freelist::init_list_head(void* start, void* end)
+    void freelist_base::init_list_head(void* start, void* end)
     {
-        head        = alloc_list_node();
+        by_addr.clear();
+        by_size.clear();
+        std::fill(std::begin(bins), std::end(bins), nullptr);
+        std::fill(std::begin(bin_map), std::end(bin_map), 0);
+        std::fill(std::begin(bin_largest), std::end(bin_largest), 0);
+        std::fill(std::begin(bin_largest_count), std::end(bin_largest_count), 0);
+        free_bytes = 0;
+        extents    = 0;
+
+        if(start == end)
+        {
+            return;
+        }
+
+        auto head   = alloc_list_node();
         head->start = start;
         head->end   = end;
-        head->next  = nullptr;
-        tail        = head;
+        insert(head, nullptr, nullptr);
     }
 
-    node_ptr freelist::search(void* addr)
+    node_ptr freelist_base::search(void* addr)
     {
+        // the only node that can hold addr is the last one starting at or before it
+        auto next   = by_addr.upper_bound(addr);
+        auto target = next ? address_tree::prev(next) : by_addr.last();
 
-        if(head)
-        {
-            assert(tail && "Freelist corrupted: tail pointer is null, but head is not null");
-            assert(tail->next == nullptr &&
-                   "Freelist corrupted: tail pointer does not point to the end of the freelist");
-        }
-
-        auto temp = head;
-        for(; temp != nullptr && !temp->hasAddr(addr); temp = temp->next)
+        if(target && target->hasAddr(addr))
         {
+            return target;
         }
-
-        // temp is either nullptr or has our address
-        return temp;
+        return nullptr;
     }
 
-    void* freelist::split_node(void* ptr, size_t size)
+    void* freelist_base::split_node(void* ptr, size_t size)
     {
 
         auto addr   = static_cast<char*>(ptr);
@@ -87,6 +103,11 @@ namespace alloc
             return nullptr;
         }
 
+        return carve(target, addr, size);
+    }
+
+    void* freelist_base::carve(node_ptr target, char* addr, size_t size)
+    {
         auto new_end = addr + size;
 
         // ensure the node has enough space to satisfy the allocation
@@ -100,27 +121,12 @@ namespace alloc
             // shrink the node from the front
             if(new_end < target->end)
             {
-                target->start = new_end;
+                resize_node(target, new_end, target->end);
             }
             else if(new_end == target->end)
             {
-                assert(head != nullptr && "Freelist corrupted: head pointer is null");
                 // remove this node completely
-                auto prev = head;
-                if(prev != target)
-                {
-                    // walk the list until prev
-                    while(prev->next != target)
-                    {
-                        prev = prev->next;
-                    }
-                }
-                else
-                {
-                    prev = nullptr;
-                }
-
-                remove_node(prev, target, target->next);
+                remove_node(address_tree::prev(target), target, address_tree::next(target));
             }
             else
             {
@@ -142,258 +148,369 @@ namespace alloc
                 temp->end   = target->end;
 
                 // update this node's end address
-                target->end = addr;
+                resize_node(target, target->start, addr);
 
                 // insert node into freelist
-                insert(temp, target, target->next);
+                insert(temp, target, address_tree::next(target));
             }
             else if(new_end == target->end)
             {
                 // truncate the node from the end
-                target->end = addr;
+                resize_node(target, target->start, addr);
             }
         }
         return addr;
     }
 
-    node_ptr freelist::alloc_list_node() const
+    void freelist_base::resize_node(node_ptr node, void* start, void* end)
     {
-        internal_arena* arena_ptr = const_cast<internal_arena*>(&arena);
-        auto temp_allocator       = utils::internal_arena_allocator<freelist_node>(arena_ptr);
-        return temp_allocator.allocate(1);
+        // the address order is unaffected as long as the node stays between its neighbors,
+        // but the node may now belong to a different bin
+        unindex_node(node);
+        node->start = start;
+        node->end   = end;
+        index_node(node);
     }
 
-    void freelist::dealloc_list_node(freelist_node* node) const
+    size_t freelist_base::bin_index(size_t pages)
     {
-        internal_arena* arena_ptr = const_cast<internal_arena*>(&arena);
-        auto temp_allocator       = utils::internal_arena_allocator<freelist_node>(arena_ptr);
-        temp_allocator.deallocate(node, 1);
+        if(pages <= exact_bins)
+        {
+            return pages - 1;
+        }
+
+        // power of two bins start at the first page count without an exact bin
+        auto log2 = 63U - static_cast<unsigned>(__builtin_clzl(pages));
+        return exact_bins + log2 - 6U;
     }
 
-    void freelist::insert(node_ptr new_node, freelist_node* first, node_ptr last)
+    void freelist_base::index_node(node_ptr node)
     {
-        if(last == head)
+        free_bytes += static_cast<size_t>(node->size());
+        extents++;
+
+        auto pages = static_cast<size_t>(node->size()) / utils::min_alignment;
+        if(pages >= large_pages)
         {
-            head = new_node;
+            by_size.insert(node);
+            return;
         }
-        else
+
+        // push onto the front of the bin
+        auto idx            = bin_index(pages);
+        node->bin_link.prev = nullptr;
+        node->bin_link.next = bins[idx];
+        if(bins[idx])
         {
-            first->next = new_node;        // first gets a new forward link
-            assert((first->end <= new_node->start) &&
-                   "Freelist insertion failed: the new block starts before preceding block ends");
+            bins[idx]->bin_link.prev = node;
         }
+        bins[idx] = node;
+        bin_map[idx / 64] |= 1UL << (idx % 64);
 
-        if(first == tail)
+        if(idx >= exact_bins)
         {
-            tail = new_node;
+            auto size = static_cast<size_t>(node->size());
+            auto sub  = idx - exact_bins;
+            if(size > bin_largest[sub])
+            {
+                bin_largest[sub]       = size;
+                bin_largest_count[sub] = 1;
+            }
+            else if(size == bin_largest[sub])
+            {
+                bin_largest_count[sub]++;
+            }
         }
-        else
+    }
+
+    void freelist_base::unindex_node(node_ptr node)
+    {
+        free_bytes -= static_cast<size_t>(node->size());
+        extents--;
+
+        auto pages = static_cast<size_t>(node->size()) / utils::min_alignment;
+        if(pages >= large_pages)
         {
+            by_size.erase(node);
+            return;
+        }
 
-            assert((new_node->end <= last->start) &&
-                   "Freelist insertion failed: the new block ends before next block starts");
+        auto idx = bin_index(pages);
+        if(node->bin_link.prev)
+        {
+            node->bin_link.prev->bin_link.next = node->bin_link.next;
+        }
+        else
+        {
+            bins[idx] = node->bin_link.next;
+            if(!bins[idx])
+            {
+                bin_map[idx / 64] &= ~(1UL << (idx % 64));
+            }
         }
 
-        // new_node links to the old nodes
-        new_node->next = last;        // can be nullptr
-        if(tail == new_node)
+        if(node->bin_link.next)
         {
-            assert(tail->next == nullptr &&
-                   "Freelist corrupted: tail pointer does not point to the end of the freelist");
+            node->bin_link.next->bin_link.prev = node->bin_link.prev;
         }
-    }
 
-    void freelist::remove(void* addr, size_t size)
-    {
-        split_node(addr, size);
+        if(idx >= exact_bins)
+        {
+            auto sub = idx - exact_bins;
+            if(!bins[idx])
+            {
+                bin_largest[sub]       = 0;
+                bin_largest_count[sub] = 0;
+            }
+            else if(static_cast<size_t>(node->size()) == bin_largest[sub] && bin_largest_count[sub] > 0)
+            {
+                bin_largest_count[sub]--;
+            }
+        }
     }
 
-    void freelist::remove_node(node_ptr first, freelist_node* target, node_ptr last)
+    node_ptr freelist_base::find_bin(size_t first_bin) const
     {
-        if(!first && !last)
+        // scan the bitmap for the first non-empty bin at or above first_bin
+        for(auto word = first_bin / 64; word < sizeof(bin_map) / sizeof(bin_map[0]); ++word)
         {
-            head = nullptr;
-            tail = nullptr;
-        }
-        else
-        {
-            assert((tail && (tail->next == nullptr)) &&
-                   "Freelist corrupted: tail pointer does not point to the end of the freelist");
-            if(target == head)
+            auto bits = bin_map[word];
+            if(word == first_bin / 64)
             {
-                head = last;
+                bits &= ~0UL << (first_bin % 64);
             }
 
-            if(target == tail)
+            if(bits)
             {
-                tail = first;
-                assert(last == nullptr && "Freelist corrupted: removal target was tail, but last was not nullptr");
+                return bins[word * 64 + __builtin_ctzl(bits)];
             }
+        }
+        return nullptr;
+    }
 
-            if(first)
-                first->next = last;
+    node_ptr freelist_base::alloc_list_node() const
+    {
+        internal_arena* arena_ptr = const_cast<internal_arena*>(&arena);
+        auto temp_allocator       = utils::internal_arena_allocator<freelist_node>(arena_ptr);
+        auto node                 = temp_allocator.allocate(1);
+        if(!node)
+        {
+            // list nodes never leave the protected region, so there is nowhere else to put them
+            fprintf(stderr, "Freelist metadata exhausted: cannot track any more free blocks!\n");
+            exit(EXIT_FAILURE);
+        }
+        return node;
+    }
 
-            assert(tail->next == nullptr &&
-                   "Freelist corrupted: tail pointer does not point to the end of the freelist");
-        }        // else
+    void freelist_base::dealloc_list_node(freelist_node* node) const
+    {
+        internal_arena* arena_ptr = const_cast<internal_arena*>(&arena);
+        auto temp_allocator       = utils::internal_arena_allocator<freelist_node>(arena_ptr);
+        temp_allocator.deallocate(node, 1);
+    }
+
+    void freelist_base::insert(node_ptr new_node, [[maybe_unused]] freelist_node* first, [[maybe_unused]] node_ptr last)
+    {
+        assert((!first || first->end <= new_node->start) &&
+               "Freelist insertion failed: the new block starts before preceding block ends");
+        assert((!last || new_node->end <= last->start) &&
+               "Freelist insertion failed: the new block ends before next block starts");
+
+        by_addr.insert(new_node);
+        index_node(new_node);
+
+        assert(address_tree::prev(new_node) == first &&
+               "Freelist corrupted: the new block was not inserted after the preceding block");
+        assert(address_tree::next(new_node) == last &&
+               "Freelist corrupted: the new block was not inserted before the next block");
+    }
+
+    void freelist_base::remove(void* addr, size_t size)
+    {
+        split_node(addr, size);
+    }
+
+    void freelist_base::remove_node([[maybe_unused]] node_ptr first, freelist_node* target,
+                                    [[maybe_unused]] node_ptr last)
+    {
+        assert(address_tree::prev(target) == first && "Freelist corrupted: first does not precede the removal target");
+        assert(address_tree::next(target) == last && "Freelist corrupted: last does not follow the removal target");
 
+        by_addr.erase(target);
+        unindex_node(target);
         dealloc_list_node(target);
     }
 
-    void freelist::coalesce()
+    void freelist_base::coalesce()
     {
-        auto cur = head;
-        while(cur != tail)
+        auto cur = by_addr.first();
+        while(cur)
         {
             // coalesce nodes, and throw away the duplicates
-            while(cur->next && (cur->next->start == cur->end))
+            auto next = address_tree::next(cur);
+            while(next && (next->start == cur->end))
             {
-                cur->end = cur->next->end;
-
-                remove_node(cur, cur->next, cur->next->next);
+                auto next_end = next->end;
+                remove_node(cur, next, address_tree::next(next));
+                resize_node(cur, cur->start, next_end);
+                next = address_tree::next(cur);
             }        // while
 
             // advance the cur pointer
-            if(cur->next)
-            {
-                cur = cur->next;
-            }
+            cur = next;
         }        // while
     }
 
-    void freelist::return_region(void* addr, size_t size)
+    void freelist_base::return_region(void* addr, size_t size)
     {
 
-        // walk freelist until we find the slot for this memory
-        char* begin     = static_cast<char*>(addr);
-        char* end       = begin + size;
-        auto new_node   = alloc_list_node();
-        new_node->start = begin;
-        new_node->end   = end;
+        // find the slot for this memory, which is always a whole number of pages (see munmap())
+        char* begin   = static_cast<char*>(addr);
+        char* end     = begin + utils::get_aligned_size(size, utils::min_alignment);
+        auto next_ptr = by_addr.lower_bound(begin);
+        auto curr_ptr = next_ptr ? address_tree::prev(next_ptr) : by_addr.last();
+
+        assert((!curr_ptr || curr_ptr->end <= begin) && "Freelist corrupted: returned region overlaps a free block");
+        assert((!next_ptr || end <= next_ptr->start) && "Freelist corrupted: returned region overlaps a free block");
 
-        if(!head && !tail)
+        // merge with the immediate neighbors only; the rest of the list is already coalesced
+        bool merge_prev = curr_ptr && curr_ptr->end == begin;
+        bool merge_next = next_ptr && next_ptr->start == end;
+
+        if(merge_prev && merge_next)
         {
-            // create new node with this region and set it to head and tail
-            insert(new_node, head, tail);
+            auto next_end = next_ptr->end;
+            remove_node(curr_ptr, next_ptr, address_tree::next(next_ptr));
+            resize_node(curr_ptr, curr_ptr->start, next_end);
+        }
+        else if(merge_prev)
+        {
+            resize_node(curr_ptr, curr_ptr->start, end);
+        }
+        else if(merge_next)
+        {
+            // growing the node downwards keeps it between the same neighbors
+            resize_node(next_ptr, begin, next_ptr->end);
         }
         else
         {
-
-            assert(head && "Freelist corrupted: tail pointer is null, but head is not null");
-            auto curr_ptr = head;
-            auto next_ptr = curr_ptr->next;
-
-            if(head && (end <= head->start))
-            {
-                // insert node before this node .. can only happen at head?
-                insert(new_node, nullptr, head);
-            }
-            else if(tail && (begin >= tail->end))
-            {
-                // insert node after tail
-                insert(new_node, tail, nullptr);
-            }
-            else
-            {
-                bool inserted = false;
-                // loop over freelist
-                while(curr_ptr && next_ptr)
-                {
-                    if((begin >= curr_ptr->end) && (end <= next_ptr->start))
-                    {
-                        // insert node
-                        insert(new_node, curr_ptr, next_ptr);
-                        inserted = true;
-                        break;
-                    }
-
-                    // advance pointers
-                    curr_ptr = next_ptr;
-                    next_ptr = next_ptr->next;
-                }        // while
-                assert(inserted && "Error inserting into freelist, no suitable block for insertion");
-            }        // else
-        }            // else
-
-        // we added to the list, so coalesce all nodes
-        coalesce();
+            auto new_node   = alloc_list_node();
+            new_node->start = begin;
+            new_node->end   = end;
+            insert(new_node, curr_ptr, next_ptr);
+        }
     }
 
-    void* freelist::request(void* addr, size_t size, size_t align)
+    void* freelist_base::take_free(void* begin, void* end, size_t& length)
     {
-        // no zero sized allocations
-        if(size == 0)
-            return nullptr;
-
-        // calculate the new size with requested alignment
-        auto unaligned  = size % utils::min_alignment;
-        size_t new_size = unaligned ? size + (utils::min_alignment - unaligned) : size;
-
-        if(!addr)
+        // the node holding begin, if any, or else the first one after it
+        auto node = search(begin);
+        if(!node || node->end == begin)
         {
-            // search for a suitable block
-            return find_first_block(align, new_size);
+            node = by_addr.upper_bound(begin);
         }
-        else
+
+        if(!node || node->start >= end)
         {
-            // if the request if for a fixed mapping, try to satisfy it
-            auto next_aligned = utils::get_aligned(addr, align);
-            return split_node(next_aligned, new_size);
+            return nullptr;
         }
+
+        auto first = std::max(static_cast<char*>(node->start), static_cast<char*>(begin));
+        auto last  = std::min(static_cast<char*>(node->end), static_cast<char*>(end));
+        length     = last - first;
+        return carve(node, first, length);
+    }
+
+    bool freelist_base::fits(const freelist_node& node, size_t align, size_t new_size)
+    {
+        auto next_aligned = static_cast<char*>(utils::get_aligned(node.start, align));
+        return next_aligned + new_size <= node.end;
     }
 
-    void* freelist::find_first_block(size_t align, size_t new_size)
+    void* freelist_base::aligned_alloc(size_t align, size_t new_size, freelist_node& curr)
     {
-        auto curr = head;
+        auto next_aligned = static_cast<char*>(utils::get_aligned(curr.start, align));
+        return carve(&curr, next_aligned, new_size);
+    }
 
-        // ensure that curr was a valid pointer
+    void freelist_base::release_freelist()
+    {
+        auto curr = by_addr.first();
         while(curr)
         {
-            if(curr->size() >= new_size)
-            {
-                return aligned_alloc(align, new_size, *curr);
-            }
-            curr = curr->next;
+            auto temp = curr;
+            curr      = address_tree::next(curr);
+
+            // return every node to the arena's pool
+            dealloc_list_node(temp);
         }
-        return nullptr;
+        by_addr.clear();
+        by_size.clear();
+        std::fill(std::begin(bins), std::end(bins), nullptr);
+        std::fill(std::begin(bin_map), std::end(bin_map), 0);
+        std::fill(std::begin(bin_largest), std::end(bin_largest), 0);
+        std::fill(std::begin(bin_largest_count), std::end(bin_largest_count), 0);
+        free_bytes = 0;
+        extents    = 0;
     }
 
-    void* freelist::aligned_alloc(size_t align, size_t new_size, freelist_node& curr)
+    ptrdiff_t freelist_base::mem_available()
     {
-        auto next_aligned = utils::get_aligned(curr.start, align);
-        return split_node(next_aligned, new_size);
+        return static_cast<ptrdiff_t>(free_bytes);
     }
 
-    void freelist::release_freelist()
+    size_t freelist_base::extent_count() const
     {
-        while(head)
+        return extents;
+    }
+
+    size_t freelist_base::largest_extent() const
+    {
+        if(!by_size.empty())
         {
-            auto temp = head;
-            head      = head->next;
+            return size_order::extent_size(by_size.last());
+        }
 
-            bool mapped = is_mapped_node(temp);
+        // find the highest non-empty bin
+        for(auto word = sizeof(bin_map) / sizeof(bin_map[0]); word-- > 0;)
+        {
+            if(!bin_map[word])
+            {
+                continue;
+            }
 
-            // delete the list, ignoring any mapped nodes
-            if(!mapped)
+            auto idx = word * 64 + 63 - __builtin_clzl(bin_map[word]);
+            if(idx < exact_bins)
             {
-                delete(temp);
+                return (idx + 1) * utils::min_alignment;
             }
-        }
-    }
 
-    ptrdiff_t freelist::mem_available()
-    {
-        auto tmp = head;
-        ptrdiff_t sum = 0;
-        while(tmp)
-        {
-            sum += tmp->size();
-            tmp = tmp->next;
+            // power of two bins hold a range of sizes. Their largest is only searched for once it has left the bin, so
+            // the walk is paid once per emptying rather than on every call
+            auto sub = idx - exact_bins;
+            if(bin_largest_count[sub] == 0)
+            {
+                bin_largest[sub] = 0;
+                for(auto curr = bins[idx]; curr != nullptr; curr = curr->bin_link.next)
+                {
+                    auto size = size_order::extent_size(curr);
+                    if(size > bin_largest[sub])
+                    {
+                        bin_largest[sub]       = size;
+                        bin_largest_count[sub] = 1;
+                    }
+                    else if(size == bin_largest[sub])
+                    {
+                        bin_largest_count[sub]++;
+                    }
+                }
+            }
+            return bin_largest[sub];
         }
-        return sum;
+        return 0;
     }
 
-    bool freelist::is_mapped_node(node_ptr ptr) const
+    bool freelist_base::is_mapped_node(node_ptr ptr) const
     {
         // list array is guaranteed to be the start of a page
         uintptr_t mapped  = reinterpret_cast<uintptr_t>(list_ary);
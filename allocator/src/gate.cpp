@@ -0,0 +1,131 @@
+// gate.cpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <gate.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace alloc
+{
+    namespace gate
+    {
+        namespace
+        {
+            std::atomic<thread_state*> states(nullptr);        // every state ever created
+            std::atomic<site*> sites(nullptr);                 // every site that has recorded a switch
+
+            // releases the thread's state for adoption when the thread exits
+            struct detacher
+            {
+                ~detacher()
+                {
+                    if(state)
+                    {
+                        state->in_use.store(false, std::memory_order_release);
+                        state = nullptr;
+                    }
+                }
+            };
+
+            thread_local detacher on_exit;
+
+            unsigned int bucket_of(uint64_t cycles)
+            {
+                auto bucket = 63U - static_cast<unsigned int>(__builtin_clzll(cycles | 1U));
+                return bucket < histogram_buckets ? bucket : histogram_buckets - 1;
+            }
+        }        // namespace
+
+        thread_state* attach() noexcept
+        {
+            // adopt the state of an exited thread if there is one
+            thread_state* s = states.load(std::memory_order_acquire);
+            for(; s != nullptr; s = s->next)
+            {
+                bool expected = false;
+                if(s->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                {
+                    break;
+                }
+            }
+
+            if(s == nullptr)
+            {
+                s = new thread_state();
+                s->in_use.store(true, std::memory_order_relaxed);
+                s->next = states.load(std::memory_order_relaxed);
+                while(!states.compare_exchange_weak(s->next, s, std::memory_order_release, std::memory_order_relaxed))
+                {
+                }
+            }
+
+            (void)&on_exit;        // construct the thread's detacher
+            state = s;
+            return s;
+        }
+
+        uint64_t crossings() noexcept
+        {
+            uint64_t total = 0;
+            for(auto s = states.load(std::memory_order_acquire); s != nullptr; s = s->next)
+            {
+                total += s->crossings.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        void record(site& s, uint64_t cycles) noexcept
+        {
+            __atomic_fetch_add(&s.buckets[bucket_of(cycles)], 1, __ATOMIC_RELAXED);
+
+            // register the site the first time it is used
+            int expected = 0;
+            if(__atomic_load_n(&s.registered, __ATOMIC_ACQUIRE) == 0 &&
+               __atomic_compare_exchange_n(&s.registered, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                s.next = sites.load(std::memory_order_relaxed);
+                while(!sites.compare_exchange_weak(s.next, &s, std::memory_order_release, std::memory_order_relaxed))
+                {
+                }
+            }
+        }
+
+        site* first_site() noexcept
+        {
+            return sites.load(std::memory_order_acquire);
+        }
+
+        void overflow() noexcept
+        {
+            fprintf(stderr, "Call gates nested more than %u deep\n", max_depth);
+            abort();
+        }
+
+        void underflow() noexcept
+        {
+            fprintf(stderr, "Call gate exited without a matching enter\n");
+            abort();
+        }
+    }        // namespace gate
+}        // namespace alloc
@@ -20,8 +20,10 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
 // IN THE SOFTWARE.
 
+#include <algorithm>
 #include <cstddef>
 #include <internal_arena.hpp>
+#include <iterator>
 
 namespace alloc
 {
@@ -31,10 +33,37 @@ namespace alloc
         length = (len);
         curr   = static_cast<char*>(start);
         end    = (static_cast<char*>(start) + length);
+        std::fill(std::begin(pools), std::end(pools), nullptr);
+    }
+
+    bool internal_arena::is_pooled(size_t n, size_t align)
+    {
+        return n != 0 && n <= max_pooled && align <= pool_granularity;
+    }
+
+    size_t internal_arena::pool_index(size_t n)
+    {
+        return (n - 1) / pool_granularity;
     }
 
     void* internal_arena::allocate(size_t n, size_t align)
     {
+        if(is_pooled(n, align))
+        {
+            // reuse a freed block of the same size class
+            auto idx = pool_index(n);
+            if(pools[idx])
+            {
+                auto block = pools[idx];
+                pools[idx] = block->next;
+                return block;
+            }
+
+            // carve a block that is large and aligned enough to be recycled by any request in its class
+            n     = (idx + 1) * pool_granularity;
+            align = pool_granularity;
+        }
+
         size_t remaining = static_cast<char*>(end) - curr;
         auto temp        = static_cast<void*>(curr);
         void* offset     = std::align(align, n, temp, remaining);
@@ -42,29 +71,27 @@ namespace alloc
         if(offset != nullptr)
         {
             curr = static_cast<char*>(offset) + n;
-            return offset;
-        }
-        else
-        {
-            return ::operator new(n);
         }
+        return offset;
     }
 
     void internal_arena::dealocate(void* p, std::size_t n)
     {
-        // currently the internal_arena_allocator takes care of
-        // deallocating all requests to deallocate memory.
-
-        // only delete memory from outside the arena
-        if(p < start || p > end)
+        // only memory from the arena can be recycled
+        if(!in_arena(p) || !is_pooled(n, 1))
         {
-            // delete(p,n);
+            return;
         }
+
+        auto block  = static_cast<free_block*>(p);
+        auto idx    = pool_index(n);
+        block->next = pools[idx];
+        pools[idx]  = block;
     }
 
     bool internal_arena::in_arena(void* p)
     {
-        return p >= start && p <= end;
+        return p >= start && p < end;
     }
 
 }        // namespace alloc
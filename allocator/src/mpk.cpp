@@ -26,6 +26,7 @@
 // set to 1 if we can use the same implementation for pkey_mprotect as glibc-2.27
 
 #include "mpk.h"
+#include "pkru.hpp"
 
 #include <cerrno>
 #include <cstdio>
@@ -37,40 +38,30 @@ extern "C"
 {
 
     /* Return the value of the PKRU register.  */
-    inline unsigned int pkru_pkey_read()
+    unsigned int pkru_pkey_read()
     {
-#if HAS_MPK
-        unsigned int result;
-        __asm__ volatile(".byte 0x0f, 0x01, 0xee" : "=a"(result) : "c"(0) : "rdx");
-        return result;
-#else
-        return 0;
-#endif
+        return alloc::pkru::read();
     }
 
     /* Overwrite the PKRU register with VALUE.  */
-    inline void pkru_pkey_write(unsigned int pkru)
+    void pkru_pkey_write(unsigned int pkru)
     {
-#if HAS_MPK
-        unsigned int eax = pkru;
-        unsigned int ecx = 0;
-        unsigned int edx = 0;
-
-        asm volatile(".byte 0x0f,0x01,0xef\n\t" : : "a"(eax), "c"(ecx), "d"(edx));
-#endif
+        // go through the thread's shadow, which the gates trust to skip redundant writes. The register may have been
+        // written behind its back, so reload it first
+        alloc::pkru::shadow::refresh();
+        alloc::pkru::shadow::write(pkru);
     }
 
     /*return the set bits of pkru for the input key */
     int pkru_pkey_get(int key)
     {
 #if HAS_MPK
-        if(key < 0 || key > 15)
+        if(key < 0 || key >= alloc::pkru::key_count)
         {
             errno = EINVAL;
             return -1;
         }
-        unsigned int pkru = pkru_pkey_read();
-        return (pkru >> (2 * key)) & 3;
+        return static_cast<int>(alloc::pkru::get(key));
 #else
         return 0;
 #endif
@@ -80,15 +71,13 @@ extern "C"
     int pkru_pkey_set(int key, unsigned int rights)
     {
 #if HAS_MPK
-        if(key < 0 || key > 15 || rights > 3)
+        if(key < 0 || key >= alloc::pkru::key_count || rights > 3)
         {
             errno = EINVAL;
             return -1;
         }
-        unsigned int mask = 3 << (2 * key);
-        unsigned int pkru = pkru_pkey_read();
-        pkru              = (pkru & ~mask) | (rights << (2 * key));
-        pkru_pkey_write(pkru);
+        alloc::pkru::shadow::refresh();
+        alloc::pkru::shadow::set(key, rights);
 #endif
         return 0;
     }
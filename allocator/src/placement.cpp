@@ -0,0 +1,177 @@
+// placement.cpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <freelist.hpp>
+
+namespace alloc
+{
+    namespace
+    {
+        constexpr size_t exact_bins  = freelist_base::exact_bins;
+        constexpr size_t large_pages = freelist_base::large_pages;
+        constexpr size_t bin_count   = freelist_base::bin_count;
+    }        // namespace
+
+    void* segregated_fit::find(freelist_base& list, size_t align, size_t new_size) noexcept
+    {
+        // any block at least this large can hold the request, whatever its alignment
+        auto padding     = align > utils::min_alignment ? align - utils::min_alignment : 0;
+        auto fit_pages   = (new_size + padding) / utils::min_alignment;
+        size_t first_bin = bin_count;
+
+        if(fit_pages < large_pages)
+        {
+            // the first bin whose every block holds fit_pages pages
+            first_bin = freelist_base::bin_index(fit_pages);
+            if(fit_pages > exact_bins && (fit_pages & (fit_pages - 1)) != 0)
+            {
+                first_bin++;
+            }
+
+            auto curr = list.find_bin(first_bin);
+            if(curr)
+            {
+                return list.aligned_alloc(align, new_size, *curr);
+            }
+        }
+
+        // best fit: start from the smallest large block that could hold the request, skipping
+        // any whose alignment padding leaves too little space
+        for(auto curr = list.by_size.lower_bound(new_size); curr != nullptr; curr = size_tree::next(curr))
+        {
+            auto ret = list.aligned_alloc(align, new_size, *curr);
+            if(ret)
+            {
+                return ret;
+            }
+        }
+
+        // the blocks in the bins below first_bin are not all large enough, so check them one by one
+        auto idx = freelist_base::bin_index(new_size / utils::min_alignment);
+        for(; idx < first_bin && idx < bin_count; ++idx)
+        {
+            for(auto curr = list.bins[idx]; curr != nullptr; curr = curr->bin_link.next)
+            {
+                auto ret = list.aligned_alloc(align, new_size, *curr);
+                if(ret)
+                {
+                    return ret;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    void* first_fit::find(freelist_base& list, size_t align, size_t size) noexcept
+    {
+        for(auto curr = list.by_addr.first(); curr != nullptr; curr = address_tree::next(curr))
+        {
+            if(freelist_base::fits(*curr, align, size))
+            {
+                return list.aligned_alloc(align, size, *curr);
+            }
+        }
+        return nullptr;
+    }
+
+    void* next_fit::find(freelist_base& list, size_t align, size_t size) noexcept
+    {
+        // the remainder of the extent the last region came from starts at the rover
+        auto from = rover ? list.by_addr.lower_bound(rover) : list.by_addr.first();
+        for(auto curr = from; curr != nullptr; curr = address_tree::next(curr))
+        {
+            if(freelist_base::fits(*curr, align, size))
+            {
+                auto ret = static_cast<char*>(list.aligned_alloc(align, size, *curr));
+                rover    = ret + size;
+                return ret;
+            }
+        }
+
+        // wrap around to the start of the region
+        for(auto curr = list.by_addr.first(); curr != from; curr = address_tree::next(curr))
+        {
+            if(freelist_base::fits(*curr, align, size))
+            {
+                auto ret = static_cast<char*>(list.aligned_alloc(align, size, *curr));
+                rover    = ret + size;
+                return ret;
+            }
+        }
+        return nullptr;
+    }
+
+    void* best_fit::find(freelist_base& list, size_t align, size_t size) noexcept
+    {
+        return find_best(list, align, size, false);
+    }
+
+    void* best_fit::find_best(freelist_base& list, size_t align, size_t size, bool lowest_address) noexcept
+    {
+        // bins hold increasing ranges of sizes, so the first bin with an extent that fits holds the best one
+        for(auto idx = freelist_base::bin_index(size / utils::min_alignment); idx < bin_count; ++idx)
+        {
+            node_ptr best = nullptr;
+            for(auto curr = list.bins[idx]; curr != nullptr; curr = curr->bin_link.next)
+            {
+                if(!freelist_base::fits(*curr, align, size))
+                {
+                    continue;
+                }
+
+                auto curr_size = curr->size();
+                auto best_size = best ? best->size() : 0;
+                if(!best || curr_size < best_size || (curr_size == best_size && curr->start < best->start))
+                {
+                    best = curr;
+                }
+
+                // every extent in an exact bin has the same size, so the first that fits is as good as any
+                if(idx < exact_bins && !lowest_address)
+                {
+                    break;
+                }
+            }
+
+            if(best)
+            {
+                return list.aligned_alloc(align, size, *best);
+            }
+        }
+
+        // the size index orders extents of the same size by address
+        for(auto curr = list.by_size.lower_bound(size); curr != nullptr; curr = size_tree::next(curr))
+        {
+            if(freelist_base::fits(*curr, align, size))
+            {
+                return list.aligned_alloc(align, size, *curr);
+            }
+        }
+        return nullptr;
+    }
+
+    void* address_best_fit::find(freelist_base& list, size_t align, size_t size) noexcept
+    {
+        return find_best(list, align, size, true);
+    }
+}        // namespace alloc
@@ -0,0 +1,238 @@
+// ready_pool.cpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <ready_pool.hpp>
+#include <pkru.hpp>
+
+#include <algorithm>
+
+namespace alloc
+{
+    ready_pool::ready_pool(vma* backing) noexcept
+      : backing(backing), class_count(0), depth(0), low_water(0), prefault(false), refill_wanted(false),
+        stop_refiller(false), passes(0)
+    {
+    }
+
+    ready_pool::~ready_pool() noexcept
+    {
+        disable();
+    }
+
+    bool ready_pool::configure(const size_t* sizes, size_t count, size_t depth, size_t low_water,
+                               bool prefault) noexcept
+    {
+        if(count > max_classes || (count != 0 && (depth == 0 || low_water == 0 || low_water > depth)))
+        {
+            return false;
+        }
+
+        disable();
+        if(count == 0)
+        {
+            return true;
+        }
+
+        // a map() that loaded the old class count may still be looking at the classes, so they change under their locks
+        this->depth    = depth;
+        this->prefault = prefault;
+        this->low_water.store(low_water, std::memory_order_relaxed);
+        for(size_t i = 0; i < count; ++i)
+        {
+            auto& c = classes[i];
+            std::lock_guard<std::mutex> guard(c.lock);
+            c.length.store(utils::get_aligned_size(sizes[i], utils::min_alignment), std::memory_order_relaxed);
+            c.hits    = 0;
+            c.misses  = 0;
+            c.refills = 0;
+            c.regions.reserve(depth);
+        }
+        class_count.store(count, std::memory_order_release);
+
+        // the first fill also runs on the refiller, so that only it ever needs access to the pages
+        std::unique_lock<std::mutex> guard(refill_lock);
+        stop_refiller = false;
+        refill_wanted = true;
+        passes        = 0;
+        refiller      = std::thread(&ready_pool::refill_loop, this);
+        refill_wake.wait(guard, [this] { return passes != 0; });
+        return true;
+    }
+
+    void ready_pool::disable() noexcept
+    {
+        // a map() that loaded the count before it was zeroed may still pop a region under the class lock. Once a class
+        // is emptied and its length cleared under that lock, such a map() can only miss it
+        auto count = class_count.exchange(0, std::memory_order_acq_rel);
+        if(refiller.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> guard(refill_lock);
+                stop_refiller = true;
+            }
+            refill_wake.notify_all();
+            refiller.join();
+        }
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            auto& c = classes[i];
+            std::lock_guard<std::mutex> guard(c.lock);
+            auto length = c.length.load(std::memory_order_relaxed);
+            for(auto region : c.regions)
+            {
+                backing->unmap_region(region, length);
+            }
+            c.regions.clear();
+            c.length.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void* ready_pool::map(size_t length, int prot) noexcept
+    {
+        auto count = class_count.load(std::memory_order_acquire);
+        if(count == 0 || prot != ready_prot || length == 0)
+        {
+            return nullptr;
+        }
+
+        auto len = utils::get_aligned_size(length, utils::min_alignment);
+        for(size_t i = 0; i < count; ++i)
+        {
+            auto& c = classes[i];
+            if(c.length.load(std::memory_order_relaxed) != len)
+            {
+                continue;
+            }
+
+            void* region = nullptr;
+            bool refill  = false;
+            {
+                std::lock_guard<std::mutex> guard(c.lock);
+                if(c.length.load(std::memory_order_relaxed) != len)
+                {
+                    continue;
+                }
+
+                if(c.regions.empty())
+                {
+                    c.misses++;
+                }
+                else
+                {
+                    region = c.regions.back();
+                    c.regions.pop_back();
+                    c.hits++;
+                }
+
+                // a refill that could not map every region is retried by the next request, not only as the class
+                // crosses its low-water mark
+                refill = region == nullptr || c.regions.size() < low_water.load(std::memory_order_relaxed);
+            }
+
+            if(refill)
+            {
+                std::unique_lock<std::mutex> guard(refill_lock);
+                if(!refill_wanted)
+                {
+                    refill_wanted = true;
+                    guard.unlock();
+                    refill_wake.notify_all();
+                }
+            }
+            return region;
+        }
+        return nullptr;
+    }
+
+    void ready_pool::get_stats(ready_stats& stats) noexcept
+    {
+        stats      = ready_stats();
+        auto count = class_count.load(std::memory_order_acquire);
+        for(size_t i = 0; i < count; ++i)
+        {
+            auto& c = classes[i];
+            std::lock_guard<std::mutex> guard(c.lock);
+            stats.held += c.regions.size() * c.length;
+            stats.hits += c.hits;
+            stats.misses += c.misses;
+            stats.refills += c.refills;
+        }
+    }
+
+    void ready_pool::fill(size_class& c) noexcept
+    {
+        using namespace utils;
+        for(;;)
+        {
+            {
+                std::lock_guard<std::mutex> guard(c.lock);
+                if(c.regions.size() >= depth)
+                {
+                    return;
+                }
+            }
+
+            auto flags  = prefault ? default_flags | MAP_POPULATE : default_flags;
+            auto region = backing->map_region(nullptr, c.length, ready_prot, flags, default_fd, default_offset);
+            if(region == MAP_FAILED)
+            {
+                return;
+            }
+
+            std::lock_guard<std::mutex> guard(c.lock);
+            c.regions.push_back(region);
+            c.refills++;
+        }
+    }
+
+    void ready_pool::refill_loop() noexcept
+    {
+        // the refiller faults pooled pages in when prefaulting, so it needs access to the pkey
+        if(backing->get_pkey() != -1)
+        {
+            pkru::shadow::set(backing->get_pkey(), 0x0);
+        }
+
+        std::unique_lock<std::mutex> guard(refill_lock);
+        for(;;)
+        {
+            refill_wake.wait(guard, [this] { return refill_wanted || stop_refiller; });
+            if(stop_refiller)
+            {
+                return;
+            }
+            refill_wanted = false;
+
+            guard.unlock();
+            for(size_t i = 0; i < class_count.load(std::memory_order_acquire); ++i)
+            {
+                fill(classes[i]);
+            }
+            guard.lock();
+
+            passes++;
+            refill_wake.notify_all();
+        }
+    }
+}        // namespace alloc
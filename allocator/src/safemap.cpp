@@ -22,17 +22,338 @@
 
 #include "safemap.h"
 
+#include "classify.hpp"
+#include "domain.hpp"
+#include "extent_hooks.hpp"
+#include "gate.hpp"
+#include "pkru.hpp"
+#include "ready_pool.hpp"
+#include "thread_cache.hpp"
+#include "trace.hpp"
 #include "vma.hpp"
 
 #include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cerrno>
 #include <csignal>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <mutex>
+#include <new>
 #include <signal.h>
 
-static alloc::vma global_vma;
-std::mutex vma_lock;
-std::atomic<uint64_t> gate_count(0);
+// the batched API passes its requests straight through to the vma
+static_assert(sizeof(pk_region) == sizeof(alloc::region_request) &&
+                offsetof(pk_region, addr) == offsetof(alloc::region_request, addr) &&
+                offsetof(pk_region, length) == offsetof(alloc::region_request, length) &&
+                offsetof(pk_region, err) == offsetof(alloc::region_request, err),
+              "pk_region must match alloc::region_request");
+
+static_assert(sizeof(pk_node_stats) == sizeof(alloc::node_stats) &&
+                offsetof(pk_node_stats, reserved) == offsetof(alloc::node_stats, reserved) &&
+                offsetof(pk_node_stats, mapped) == offsetof(alloc::node_stats, mapped) &&
+                offsetof(pk_node_stats, misses) == offsetof(alloc::node_stats, misses),
+              "pk_node_stats must match alloc::node_stats");
+
+static_assert(PK_MAP_HUGEPAGE == alloc::vma::map_hugepage, "PK_MAP_HUGEPAGE must match alloc::vma::map_hugepage");
+
+static_assert(PK_MAP_POPULATE == alloc::vma::map_populate, "PK_MAP_POPULATE must match alloc::vma::map_populate");
+
+static_assert(PK_REMAP_MAYMOVE == alloc::vma::remap_maymove, "PK_REMAP_MAYMOVE must match alloc::vma::remap_maymove");
+
+static_assert(PK_GATE_BUCKETS == alloc::gate::histogram_buckets &&
+                sizeof(pk_gate_site) == sizeof(alloc::gate::site) &&
+                offsetof(pk_gate_site, buckets) == offsetof(alloc::gate::site, buckets) &&
+                offsetof(pk_gate_site, next) == offsetof(alloc::gate::site, next) &&
+                offsetof(pk_gate_site, registered) == offsetof(alloc::gate::site, registered),
+              "pk_gate_site must match alloc::gate::site");
+
+namespace
+{
+    // allocated as the library loads, before the program spawns any threads, so that every thread inherits access to
+    // it even though the region is only reserved on first use
+    int default_pkey = pkey_alloc(0, 0);
+
+    // the default domain and the services built on it, created by the first call that needs them
+    struct runtime
+    {
+        alloc::vma region;
+        alloc::ready_pool ready;
+        alloc::vma_extent_hooks jemalloc_hooks;
+
+        // the rights are left to settle_rights, as the call that reserves the region still writes its metadata
+        explicit runtime(const pk_config& config) noexcept
+          : region(std::nothrow, alloc::utils::default_shards, config.size, config.alignment, 0, default_pkey,
+                   config.numa != 0),
+            ready(&region), jemalloc_hooks(&region)
+        {
+        }
+    };
+
+    alignas(runtime) unsigned char runtime_storage[sizeof(runtime)];
+    std::atomic<runtime*> live(nullptr);
+    std::mutex init_lock;
+
+    // the configured rights, which the thread that reserved the default domain takes on once its call returns
+    unsigned int default_rights = 0;
+    thread_local bool rights_pending __attribute__((tls_model("initial-exec"))) = false;
+
+    /**
+     * Declared first in every entry point that may reserve the default domain, so that the configured rights only
+     * apply once the call is done writing the domain's metadata
+     */
+    struct settle_rights
+    {
+        ~settle_rights()
+        {
+            if(__builtin_expect(rights_pending, 0))
+            {
+                rights_pending = false;
+                alloc::pkru::shadow::set(live.load(std::memory_order_relaxed)->region.get_pkey(), default_rights);
+            }
+        }
+    };
+
+    // reads a size such as 1073741824, 64G or 1T
+    bool parse_size(const char* text, size_t& value)
+    {
+        char* end = nullptr;
+        errno     = 0;
+        auto n    = strtoull(text, &end, 0);
+        if(errno != 0 || end == text)
+        {
+            return false;
+        }
+
+        // an optional binary unit
+        const char units[] = "kmgt";
+        unsigned int shift = 0;
+        auto unit          = *end != '\0' ? strchr(units, tolower(*end)) : nullptr;
+        if(unit)
+        {
+            shift = 10 * static_cast<unsigned int>(unit - units + 1);
+            ++end;
+        }
+        if(*end != '\0' || n > (SIZE_MAX >> shift))
+        {
+            return false;
+        }
+        value = static_cast<size_t>(n) << shift;
+        return true;
+    }
+
+    bool parse_rights(const char* text, unsigned int& rights)
+    {
+        if(strcmp(text, "rw") == 0)
+        {
+            rights = 0;
+        }
+        else if(strcmp(text, "ro") == 0)
+        {
+            rights = PKEY_DISABLE_WRITE;
+        }
+        else if(strcmp(text, "none") == 0)
+        {
+            rights = PKEY_DISABLE_ACCESS;
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
+    bool valid_size(size_t size)
+    {
+        return size != 0 && size <= alloc::utils::default_size;
+    }
+
+    bool valid_alignment(size_t alignment)
+    {
+        return alignment == 0 || ((alignment & (alignment - 1)) == 0 && alignment <= alloc::utils::default_size);
+    }
+
+    bool valid_rights(unsigned int rights)
+    {
+        return rights == 0 || rights == PKEY_DISABLE_WRITE || rights == PKEY_DISABLE_ACCESS;
+    }
+
+    // fills in the fields left as 0 from the environment, and then from the defaults
+    pk_config resolve(const pk_config* requested)
+    {
+        pk_config config = requested ? *requested : pk_config{};
+
+        auto text    = getenv("PKALLOC_SIZE");
+        size_t value = 0;
+        if(config.size == 0 && text)
+        {
+            if(parse_size(text, value) && valid_size(value))
+            {
+                config.size = value;
+            }
+            else
+            {
+                fprintf(stderr, "[pkalloc]  ignoring invalid PKALLOC_SIZE=%s\n", text);
+            }
+        }
+
+        text = getenv("PKALLOC_ALIGN");
+        if(config.alignment == 0 && text)
+        {
+            if(parse_size(text, value) && valid_alignment(value))
+            {
+                config.alignment = value;
+            }
+            else
+            {
+                fprintf(stderr, "[pkalloc]  ignoring invalid PKALLOC_ALIGN=%s\n", text);
+            }
+        }
+
+        text = getenv("PKALLOC_RIGHTS");
+        if(config.rights == 0 && text && !parse_rights(text, config.rights))
+        {
+            fprintf(stderr, "[pkalloc]  ignoring invalid PKALLOC_RIGHTS=%s\n", text);
+        }
+
+        text = getenv("PKALLOC_NUMA");
+        if(config.numa == 0 && text)
+        {
+            if(strcmp(text, "0") == 0 || strcmp(text, "1") == 0)
+            {
+                config.numa = text[0] - '0';
+            }
+            else
+            {
+                fprintf(stderr, "[pkalloc]  ignoring invalid PKALLOC_NUMA=%s\n", text);
+            }
+        }
+
+        if(config.size == 0)
+        {
+            config.size = alloc::utils::default_size;
+        }
+        config.size = alloc::utils::get_aligned_size(config.size, alloc::utils::min_alignment);
+        return config;
+    }
+
+    void stop()
+    {
+        alloc::trace::stop();
+        live.load(std::memory_order_relaxed)->~runtime();
+    }
+
+    // must be called with init_lock held. Returns nullptr with errno set if the region cannot be reserved
+    runtime* start(const pk_config& config)
+    {
+        auto rt = new(runtime_storage) runtime(config);
+        if(!rt->region.reserved())
+        {
+            auto err = errno;
+            rt->~runtime();
+            errno = err;
+            return nullptr;
+        }
+
+        default_rights = config.rights;
+        rights_pending = config.rights != 0 && rt->region.get_pkey() != -1;
+        __atomic_store_n(&pk_bounds.start, rt->region.safe_begin(), __ATOMIC_RELAXED);
+        __atomic_store_n(&pk_bounds.size, rt->region.safe_end() - rt->region.safe_begin(), __ATOMIC_RELEASE);
+        alloc::domain::add(&rt->region);
+        atexit(stop);
+
+        auto trace_path = getenv("PKALLOC_TRACE");
+        if(trace_path && !alloc::trace::start(trace_path))
+        {
+            fprintf(stderr, "[pkalloc]  cannot write trace to %s: %s\n", trace_path, strerror(errno));
+        }
+        live.store(rt, std::memory_order_release);
+        return rt;
+    }
+
+    // the calls that reserve the domain lazily have no way to report failure
+    __attribute__((noinline)) runtime& start_lazily()
+    {
+        std::lock_guard<std::mutex> init_guard(init_lock);
+        auto rt = live.load(std::memory_order_acquire);
+        if(!rt)
+        {
+            auto config = resolve(nullptr);
+            rt          = start(config);
+            if(!rt)
+            {
+                fprintf(stderr, "[pkalloc]  cannot reserve %zu bytes: %s\n", config.size, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        return *rt;
+    }
+
+    inline runtime& global()
+    {
+        auto rt = live.load(std::memory_order_acquire);
+        return rt ? *rt : start_lazily();
+    }
+
+    bool is_default(alloc::vma* backing)
+    {
+        auto rt = live.load(std::memory_order_acquire);
+        return rt && backing == &rt->region;
+    }
+
+    // the default domain's pkey, which is known before the domain is reserved unless allocating it at load failed
+    int default_key()
+    {
+        return default_pkey != -1 ? default_pkey : global().region.get_pkey();
+    }
+}        // namespace
+
+thread_local alloc::thread_cache tcache(&global().region);
+struct pk_safe_bounds pk_bounds = {0, 0};
+
+static void* map_default(void* addr, size_t length, int prot, int flags, int fd, ptrdiff_t offset)
+{
+    // the caches only hold the reservation's own pages
+    if(!addr && fd == -1 && (flags & MAP_SHARED) == 0)
+    {
+        auto reused = global().ready.map(length, prot);
+        if(!reused)
+        {
+            reused = tcache.map(length, prot);
+        }
+
+        // reused regions may have been scrubbed, so they are populated like fresh ones
+        if(reused && (flags & MAP_POPULATE) != 0)
+        {
+            global().region.populate(reused, length, prot, (flags & MAP_NONBLOCK) != 0);
+        }
+        if(reused)
+        {
+            return reused;
+        }
+    }
+
+    return global().region.map_region(addr, length, prot, flags, fd, offset);
+}
+
+static void trace_batch(alloc::trace::op kind, const struct pk_region* regions, size_t count, int prot, uint64_t time)
+{
+    if(alloc::trace::enabled.load(std::memory_order_relaxed))
+    {
+        time = time != 0 ? time : alloc::trace::elapsed();
+        for(size_t i = 0; i < count; ++i)
+        {
+            if(regions[i].err == 0)
+            {
+                alloc::trace::log(kind, regions[i].addr, regions[i].length, prot, time);
+            }
+        }
+    }
+}
 __sighandler_t prevSigTermAction = nullptr;
 
 void segTermHandler(int signum)
@@ -43,10 +364,11 @@ void segTermHandler(int signum)
         raise(signum);
         return;
     }
+    std::cout << "[call-gates]  Passed: " << alloc::gate::crossings() << "\n";
+    auto rt = live.load(std::memory_order_acquire);
+    if(rt)
     {
-        std::lock_guard<std::mutex> map_guard(vma_lock);
-        std::cout << "[call-gates]  Passed: " << gate_count << "\n";
-        global_vma.print_mem();
+        rt->region.print_mem();
     }
 
     // Resume program exit.
@@ -61,31 +383,330 @@ void segTermHandler(int signum)
 extern "C"
 {
 
+    int pk_init(const struct pk_config* config)
+    {
+        settle_rights settle;
+        if(config && (!valid_alignment(config->alignment) || !valid_rights(config->rights) ||
+                      (config->size != 0 && !valid_size(config->size))))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        std::lock_guard<std::mutex> init_guard(init_lock);
+        if(live.load(std::memory_order_acquire))
+        {
+            errno = EBUSY;
+            return -1;
+        }
+        return start(resolve(config)) ? 0 : -1;
+    }
+
+    int pk_initialized()
+    {
+        return live.load(std::memory_order_acquire) != nullptr;
+    }
+
     void* map_region(void* addr, size_t length, int prot, int flags, int fd, ptrdiff_t offset)
     {
-        std::lock_guard<std::mutex> map_guard(vma_lock);
-        return global_vma.map_region(addr, length, prot, flags, fd, offset);
+        settle_rights settle;
+        tcache.record_map();
+        auto region = map_default(addr, length, prot, flags, fd, offset);
+        if(region != MAP_FAILED)
+        {
+            alloc::trace::event(alloc::trace::op_map, region, length, prot);
+        }
+        return region;
+    }
+
+    void* aligned_map_region(size_t length, size_t alignment, int prot, int flags)
+    {
+        settle_rights settle;
+        tcache.record_map();
+        auto region = global().region.aligned_map_region(length, alignment, prot, flags);
+        if(region != MAP_FAILED)
+        {
+            alloc::trace::event(alloc::trace::op_map, region, length, prot);
+        }
+        return region;
+    }
+
+    void* remap_region(void* addr, size_t old_length, size_t new_length, int flags)
+    {
+        settle_rights settle;
+        // traced as an unmap and a map. The protections are not known here, so the map carries none
+        auto started = alloc::trace::now();
+        auto region  = global().region.remap_region(addr, old_length, new_length, flags);
+        if(region != MAP_FAILED)
+        {
+            alloc::trace::event(alloc::trace::op_unmap, addr, old_length, 0, started);
+            alloc::trace::event(alloc::trace::op_map, region, new_length, 0);
+        }
+        return region;
     }
 
     int unmap_region(void* addr, size_t length)
     {
-        std::lock_guard<std::mutex> map_guard(vma_lock);
-        return global_vma.unmap_region(addr, length);
+        settle_rights settle;
+        tcache.record_unmap();
+        auto started = alloc::trace::now();
+        auto result  = tcache.unmap(addr, length) ? 0 : global().region.unmap_region(addr, length);
+        if(result == 0)
+        {
+            alloc::trace::event(alloc::trace::op_unmap, addr, length, 0, started);
+        }
+        return result;
+    }
+
+    size_t map_regions(struct pk_region* regions, size_t count, int prot)
+    {
+        settle_rights settle;
+        tcache.record_map(count);
+        auto mapped = global().region.map_regions(reinterpret_cast<alloc::region_request*>(regions), count, prot);
+        trace_batch(alloc::trace::op_map, regions, count, prot, 0);
+        return mapped;
+    }
+
+    size_t unmap_regions(struct pk_region* regions, size_t count)
+    {
+        settle_rights settle;
+        tcache.record_unmap(count);
+        auto started  = alloc::trace::now();
+        auto unmapped = global().region.unmap_regions(reinterpret_cast<alloc::region_request*>(regions), count);
+        trace_batch(alloc::trace::op_unmap, regions, count, 0, started);
+        return unmapped;
+    }
+
+    int pk_trace_start(const char* path)
+    {
+        return alloc::trace::start(path) ? 0 : -1;
+    }
+
+    void pk_trace_stop()
+    {
+        alloc::trace::stop();
+    }
+
+    void drain_thread_caches()
+    {
+        alloc::thread_cache::drain_all();
+    }
+
+    void pk_stats(struct pk_alloc_stats* stats)
+    {
+        settle_rights settle;
+        alloc::vma_stats region;
+        alloc::cache_stats caches;
+        alloc::ready_stats pool;
+        global().region.get_stats(region);
+        alloc::thread_cache::get_stats(caches);
+        global().ready.get_stats(pool);
+
+        // the counters are read one after another while other threads keep mapping, so they need not add up
+        auto unavailable = region.free + caches.cached + pool.held;
+
+        stats->reserved     = region.reserved;
+        stats->free         = region.free;
+        stats->cached       = caches.cached;
+        stats->ready        = pool.held;
+        stats->mapped       = region.reserved > unavailable ? region.reserved - unavailable : 0;
+        stats->extents      = region.extents;
+        stats->largest_free = region.largest_free;
+        stats->map_calls    = caches.map_calls;
+        stats->unmap_calls  = caches.unmap_calls;
+        stats->dirty        = region.dirty;
+        stats->purged       = region.purged;
+        stats->ready_hits   = pool.hits;
+        stats->ready_misses = pool.misses;
+    }
+
+    void* map_region_on_node(int node, size_t length, int prot)
+    {
+        settle_rights settle;
+        tcache.record_map();
+        auto region = global().region.map_region_on_node(node, length, prot);
+        if(region != MAP_FAILED)
+        {
+            alloc::trace::event(alloc::trace::op_map, region, length, prot);
+        }
+        return region;
+    }
+
+    size_t pk_numa_stats(struct pk_node_stats* stats, size_t count)
+    {
+        settle_rights settle;
+        return global().region.get_node_stats(reinterpret_cast<alloc::node_stats*>(stats), count);
+    }
+
+    void pk_set_purge_decay(long decay_ms)
+    {
+        settle_rights settle;
+        global().region.set_purge_decay(std::chrono::milliseconds(decay_ms));
+    }
+
+    int pk_ready_pool_configure(const size_t* sizes, size_t count, size_t depth, size_t low_water, int prefault)
+    {
+        settle_rights settle;
+        return global().ready.configure(sizes, count, depth, low_water, prefault != 0) ? 0 : -1;
+    }
+
+    struct extent_hooks_s* pk_extent_hooks()
+    {
+        settle_rights settle;
+        return &global().jemalloc_hooks.hooks;
+    }
+
+    struct pk_domain* pk_domain_create(size_t size)
+    {
+        return reinterpret_cast<pk_domain*>(alloc::domain::create(size));
+    }
+
+    struct pk_domain* pk_default_domain()
+    {
+        settle_rights settle;
+        return reinterpret_cast<pk_domain*>(&global().region);
+    }
+
+    struct pk_domain* domain_of(const void* addr)
+    {
+        return reinterpret_cast<pk_domain*>(alloc::domain::of(addr));
+    }
+
+    int pk_domain_pkey(struct pk_domain* domain)
+    {
+        return reinterpret_cast<alloc::vma*>(domain)->get_pkey();
+    }
+
+    void* map_region_in(struct pk_domain* domain, void* addr, size_t length, int prot, int flags, int fd,
+                        ptrdiff_t offset)
+    {
+        // the default domain keeps its caches
+        auto backing = reinterpret_cast<alloc::vma*>(domain);
+        if(is_default(backing))
+        {
+            return map_region(addr, length, prot, flags, fd, offset);
+        }
+
+        // threads that predate the domain were never granted its pkey, so its metadata is written behind its gate
+        alloc::trusted_scope trusted(backing->get_pkey());
+        return backing->map_region(addr, length, prot, flags, fd, offset);
+    }
+
+    int unmap_region_in(struct pk_domain* domain, void* addr, size_t length)
+    {
+        auto backing = reinterpret_cast<alloc::vma*>(domain);
+        if(!backing->is_safe_addr(addr))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        if(is_default(backing))
+        {
+            return unmap_region(addr, length);
+        }
+
+        alloc::trusted_scope trusted(backing->get_pkey());
+        return backing->unmap_region(addr, length);
+    }
+
+    void enter_domain(struct pk_domain* domain)
+    {
+        alloc::gate::enter_trusted(reinterpret_cast<alloc::vma*>(domain)->get_pkey());
+    }
+
+    void exit_domain()
+    {
+        alloc::gate::exit();
     }
 
     int vma_pkey()
     {
-        return global_vma.get_pkey();
+        settle_rights settle;
+        return global().region.get_pkey();
     }
 
     bool is_safe_address(void* addr)
     {
-        return global_vma.is_safe_addr(addr);
+        return pk_is_safe_address(addr);
+    }
+
+    bool is_safe_range(void* addr, size_t length)
+    {
+        auto size  = __atomic_load_n(&pk_bounds.size, __ATOMIC_ACQUIRE);
+        auto start = __atomic_load_n(&pk_bounds.start, __ATOMIC_RELAXED);
+        return alloc::classify::contains_range(start, start + size, addr, length);
+    }
+
+    size_t classify_pointers(const void** ptrs, size_t count, uint8_t* out)
+    {
+        auto size  = __atomic_load_n(&pk_bounds.size, __ATOMIC_ACQUIRE);
+        auto start = __atomic_load_n(&pk_bounds.start, __ATOMIC_RELAXED);
+        return alloc::classify::pointers(start, start + size, ptrs, count, out);
     }
 
     void inc_gate_count()
     {
-        gate_count++;
+        alloc::gate::count();
+    }
+
+    void enter_trusted()
+    {
+        alloc::gate::enter_trusted(default_key());
+    }
+
+    void exit_trusted()
+    {
+        alloc::gate::exit();
+    }
+
+    void enter_untrusted()
+    {
+        alloc::gate::enter_untrusted(default_key());
+    }
+
+    void exit_untrusted()
+    {
+        alloc::gate::exit();
+    }
+
+    unsigned int gate_depth()
+    {
+        return alloc::gate::depth();
+    }
+
+    void enter_trusted_at(struct pk_gate_site* site)
+    {
+        alloc::gate::enter_trusted(default_key(), *reinterpret_cast<alloc::gate::site*>(site));
+    }
+
+    void exit_trusted_at(struct pk_gate_site* site)
+    {
+        alloc::gate::exit(*reinterpret_cast<alloc::gate::site*>(site));
+    }
+
+    void enter_untrusted_at(struct pk_gate_site* site)
+    {
+        alloc::gate::enter_untrusted(default_key(), *reinterpret_cast<alloc::gate::site*>(site));
+    }
+
+    void exit_untrusted_at(struct pk_gate_site* site)
+    {
+        alloc::gate::exit(*reinterpret_cast<alloc::gate::site*>(site));
+    }
+
+    void pk_gate_profile(int enable)
+    {
+        alloc::gate::profiling.store(enable != 0, std::memory_order_relaxed);
+    }
+
+    uint64_t pk_gate_count()
+    {
+        return alloc::gate::crossings();
+    }
+
+    struct pk_gate_site* pk_gate_sites()
+    {
+        return reinterpret_cast<pk_gate_site*>(alloc::gate::first_site());
     }
 
     static void __attribute__((constructor)) register_term_handler()
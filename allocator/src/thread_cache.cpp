@@ -0,0 +1,188 @@
+// thread_cache.cpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include <thread_cache.hpp>
+#include <pkru.hpp>
+
+namespace alloc
+{
+    namespace
+    {
+        // registry of live caches, so they can be drained from any thread
+        std::mutex registry_lock;
+        thread_cache* registry_head = nullptr;
+        cache_stats retired;        // counters of caches whose threads have exited
+
+        // bump a counter that only the owning thread writes, without a locked instruction
+        void bump(std::atomic<uint64_t>& counter, uint64_t count)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+        }
+    }        // namespace
+
+    thread_cache::thread_cache(vma* backing) noexcept
+      : backing(backing), buckets(), prev(nullptr), next(nullptr), cached_bytes(0), map_calls(0), unmap_calls(0)
+    {
+        std::lock_guard<std::mutex> registry_guard(registry_lock);
+        next = registry_head;
+        if(registry_head)
+        {
+            registry_head->prev = this;
+        }
+        registry_head = this;
+    }
+
+    thread_cache::~thread_cache() noexcept
+    {
+        std::lock_guard<std::mutex> registry_guard(registry_lock);
+
+        // the thread may exit outside any gate, with access to the region revoked
+        if(backing->get_pkey() != -1)
+        {
+            pkru::shadow::set(backing->get_pkey(), 0x0);
+        }
+        flush();
+        retired.map_calls += map_calls.load(std::memory_order_relaxed);
+        retired.unmap_calls += unmap_calls.load(std::memory_order_relaxed);
+
+        if(prev)
+        {
+            prev->next = next;
+        }
+        else
+        {
+            registry_head = next;
+        }
+
+        if(next)
+        {
+            next->prev = prev;
+        }
+    }
+
+    size_t thread_cache::page_count(size_t length) noexcept
+    {
+        return utils::get_aligned_size(length, utils::min_alignment) / utils::min_alignment;
+    }
+
+    void* thread_cache::map(size_t length, int prot) noexcept
+    {
+        auto pages = page_count(length);
+        if(pages == 0 || pages > max_pages)
+        {
+            return nullptr;
+        }
+
+        void* addr = nullptr;
+        {
+            std::lock_guard<std::mutex> cache_guard(lock);
+            auto& b = buckets[pages - 1];
+            if(b.count == 0)
+            {
+                return nullptr;
+            }
+            addr = b.extents[--b.count];
+            cached_bytes.fetch_sub(pages * utils::min_alignment, std::memory_order_relaxed);
+        }
+
+        // the extent was scrubbed on the way in, so only the protections need to be restored
+        if(pkey_mprotect(addr, length, prot, backing->get_pkey()) == -1)
+        {
+            backing->unmap_region(addr, pages * utils::min_alignment);
+            return nullptr;
+        }
+        return addr;
+    }
+
+    bool thread_cache::unmap(void* addr, size_t length) noexcept
+    {
+        auto pages = page_count(length);
+        if(pages == 0 || pages > max_pages || !backing->is_safe_addr(addr) ||
+           addr != utils::get_aligned(addr, utils::min_alignment) || backing->is_backed(addr, length))
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> cache_guard(lock);
+        auto& b = buckets[pages - 1];
+        if(b.count == bucket_size)
+        {
+            return false;
+        }
+
+        // discard the contents and revoke access, just as the vma would
+        auto len = pages * utils::min_alignment;
+        if(madvise(addr, len, MADV_DONTNEED) == -1 || pkey_mprotect(addr, len, PROT_NONE, backing->get_pkey()) == -1)
+        {
+            return false;
+        }
+
+        b.extents[b.count++] = addr;
+        cached_bytes.fetch_add(len, std::memory_order_relaxed);
+        return true;
+    }
+
+    void thread_cache::flush() noexcept
+    {
+        std::lock_guard<std::mutex> cache_guard(lock);
+        for(size_t i = 0; i < max_pages; ++i)
+        {
+            auto& b = buckets[i];
+            while(b.count != 0)
+            {
+                backing->unmap_region(b.extents[--b.count], (i + 1) * utils::min_alignment);
+            }
+        }
+        cached_bytes.store(0, std::memory_order_relaxed);
+    }
+
+    void thread_cache::drain_all() noexcept
+    {
+        std::lock_guard<std::mutex> registry_guard(registry_lock);
+        for(auto cache = registry_head; cache != nullptr; cache = cache->next)
+        {
+            cache->flush();
+        }
+    }
+
+    void thread_cache::record_map(uint64_t count) noexcept
+    {
+        bump(map_calls, count);
+    }
+
+    void thread_cache::record_unmap(uint64_t count) noexcept
+    {
+        bump(unmap_calls, count);
+    }
+
+    void thread_cache::get_stats(cache_stats& stats) noexcept
+    {
+        std::lock_guard<std::mutex> registry_guard(registry_lock);
+        stats = retired;
+        for(auto cache = registry_head; cache != nullptr; cache = cache->next)
+        {
+            stats.cached += cache->cached_bytes.load(std::memory_order_relaxed);
+            stats.map_calls += cache->map_calls.load(std::memory_order_relaxed);
+            stats.unmap_calls += cache->unmap_calls.load(std::memory_order_relaxed);
+        }
+    }
+}        // namespace alloc
@@ -0,0 +1,208 @@
+// trace.cpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+#include <trace.hpp>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <unistd.h>
+
+namespace alloc
+{
+    namespace trace
+    {
+        namespace
+        {
+            struct buffer
+            {
+                std::mutex lock;        // only contended when stop() flushes another thread's buffer
+                uint32_t thread;
+                size_t count;
+                record records[buffer_records];
+                buffer* prev;        // links for the registry of live buffers
+                buffer* next;
+
+                buffer() noexcept;
+                ~buffer() noexcept;
+            };
+
+            std::mutex file_lock;        // guards the file, and keeps each buffer's records together in it
+            int fd = -1;
+            std::atomic<int64_t> epoch_ns(0);
+            std::atomic<uint32_t> thread_ids(0);
+
+            // registry of live buffers, so stop() can flush them all
+            std::mutex registry_lock;
+            buffer* registry_head = nullptr;
+
+            thread_local buffer local;
+
+            int64_t now_ns() noexcept
+            {
+                auto now = std::chrono::steady_clock::now().time_since_epoch();
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+            }
+
+            // must be called with file_lock held
+            void write_all(const void* data, size_t length) noexcept
+            {
+                auto p = static_cast<const char*>(data);
+                while(length != 0 && fd != -1)
+                {
+                    auto n = write(fd, p, length);
+                    if(n < 0)
+                    {
+                        if(errno == EINTR)
+                        {
+                            continue;
+                        }
+                        return;
+                    }
+                    p += n;
+                    length -= static_cast<size_t>(n);
+                }
+            }
+
+            // must be called with b.lock held. Records logged after the trace stopped are dropped here
+            void flush(buffer& b) noexcept
+            {
+                if(b.count != 0)
+                {
+                    std::lock_guard<std::mutex> file_guard(file_lock);
+                    write_all(b.records, b.count * sizeof(record));
+                    b.count = 0;
+                }
+            }
+
+            buffer::buffer() noexcept
+              : thread(thread_ids.fetch_add(1, std::memory_order_relaxed)), count(0), prev(nullptr), next(nullptr)
+            {
+                std::lock_guard<std::mutex> registry_guard(registry_lock);
+                next = registry_head;
+                if(registry_head)
+                {
+                    registry_head->prev = this;
+                }
+                registry_head = this;
+            }
+
+            buffer::~buffer() noexcept
+            {
+                std::lock_guard<std::mutex> registry_guard(registry_lock);
+                {
+                    std::lock_guard<std::mutex> buffer_guard(lock);
+                    flush(*this);
+                }
+
+                if(prev)
+                {
+                    prev->next = next;
+                }
+                else
+                {
+                    registry_head = next;
+                }
+
+                if(next)
+                {
+                    next->prev = prev;
+                }
+            }
+        }        // namespace
+
+        bool start(const char* path) noexcept
+        {
+            std::lock_guard<std::mutex> file_guard(file_lock);
+            if(fd != -1)
+            {
+                errno = EBUSY;
+                return false;
+            }
+
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(fd == -1)
+            {
+                return false;
+            }
+
+            header h = {};
+            memcpy(h.magic, magic, sizeof(magic));
+            h.version     = version;
+            h.record_size = sizeof(record);
+            write_all(&h, sizeof(h));
+
+            epoch_ns.store(now_ns(), std::memory_order_relaxed);
+            enabled.store(true, std::memory_order_release);
+            return true;
+        }
+
+        void stop() noexcept
+        {
+            if(!enabled.exchange(false, std::memory_order_acq_rel))
+            {
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> registry_guard(registry_lock);
+                for(auto b = registry_head; b != nullptr; b = b->next)
+                {
+                    std::lock_guard<std::mutex> buffer_guard(b->lock);
+                    flush(*b);
+                }
+            }
+
+            std::lock_guard<std::mutex> file_guard(file_lock);
+            close(fd);
+            fd = -1;
+        }
+
+        uint64_t elapsed() noexcept
+        {
+            return static_cast<uint64_t>(now_ns() - epoch_ns.load(std::memory_order_relaxed));
+        }
+
+        void log(op kind, const void* addr, size_t length, int prot, uint64_t time) noexcept
+        {
+            auto& b = local;
+            std::lock_guard<std::mutex> buffer_guard(b.lock);
+
+            auto& r    = b.records[b.count++];
+            r.time_ns  = time;
+            r.addr     = reinterpret_cast<uint64_t>(addr);
+            r.length   = length;
+            r.thread   = b.thread;
+            r.op       = kind;
+            r.prot     = static_cast<uint8_t>(prot);
+            r.reserved = 0;
+
+            if(b.count == buffer_records)
+            {
+                flush(b);
+            }
+        }
+    }        // namespace trace
+}        // namespace alloc
@@ -37,7 +37,13 @@ namespace alloc
         extern const int default_fd                = -1;               // required fd for MAP_ANONYMOUS
         extern const std::ptrdiff_t default_offset = 0;                // no offset allowed w/o backing file
         extern const size_t default_size           = 1UL << 46U;        // by default map half the address space
+        extern const size_t default_domain_size    = 1UL << 40U;        // room for 15 domains beside the default
         extern const int default_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;        // don't back w/ swap
+        extern const size_t default_shards = 0;                  // one shard per CPU
+        extern const size_t shard_granule  = 1UL << 30U;        // shards grow 1 GiB at a time
+        extern const size_t metadata_size  = 1UL << 26U;        // room for ~1M free blocks per freelist
+        extern const long default_decay_ms = 0;                  // scrub pages as soon as they are unmapped
+        extern const size_t decay_steps    = 20;                 // wake the purger every 1/20th of the decay
 
         size_t get_aligned_size(size_t size, size_t align)
         {
@@ -21,83 +21,671 @@
 // IN THE SOFTWARE.
 
 #include <vma.hpp>
+#include <classify.hpp>
+#include <pkru.hpp>
+#include <algorithm>
 #include <iostream>
+#include <iterator>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+// older headers lack the flag. Kernels before 5.7 reject it, and regions cannot grow on them
+#ifndef MREMAP_DONTUNMAP
+#define MREMAP_DONTUNMAP 4
+#endif
 
 namespace alloc
 {
-    vma::vma() noexcept
+    namespace
+    {
+        // end of the pages backing a region
+        char* pages_end(const region_request& r)
+        {
+            return static_cast<char*>(r.addr) + utils::get_aligned_size(r.length, utils::min_alignment);
+        }
+
+        bool by_address(const region_request* lhs, const region_request* rhs)
+        {
+            return lhs->addr < rhs->addr;
+        }
+
+        // fraction of a dirty extent that must be purged after it has been free for the given share of the decay
+        double smoothstep(double t)
+        {
+            t = std::min(1.0, std::max(0.0, t));
+            return t * t * (3.0 - 2.0 * t);
+        }
+
+        // whether the kernel has MADV_POPULATE_READ and MADV_POPULATE_WRITE (Linux 5.14): unknown until first tried,
+        // and never tried when built against headers without them
+        enum class support
+        {
+            unknown,
+            yes,
+            no
+        };
+#if defined(MADV_POPULATE_READ) && defined(MADV_POPULATE_WRITE)
+        std::atomic<support> populate_advice(support::unknown);
+#else
+        std::atomic<support> populate_advice(support::no);
+#endif
+
+        // faults in each page of a mapped region by reading it, and writing it back if the region is writable
+        void touch_pages(void* addr, size_t length, int prot)
+        {
+            auto pages = static_cast<volatile char*>(addr);
+            for(size_t off = 0; off < length; off += utils::min_alignment)
+            {
+                char value = pages[off];
+                if((prot & PROT_WRITE) != 0)
+                {
+                    pages[off] = value;
+                }
+            }
+        }
+
+        // the NUMA nodes this process may allocate from, in ascending order
+        size_t allowed_nodes(int* ids)
+        {
+            static_assert(vma::max_nodes == 64, "the node mask is a single word");
+            unsigned long mask = 0;
+            if(syscall(SYS_get_mempolicy, nullptr, &mask, vma::max_nodes, nullptr, MPOL_F_MEMS_ALLOWED) == -1)
+            {
+                return 0;
+            }
+
+            size_t count = 0;
+            for(int node = 0; node < static_cast<int>(vma::max_nodes); ++node)
+            {
+                if((mask & (1UL << static_cast<unsigned int>(node))) != 0)
+                {
+                    ids[count++] = node;
+                }
+            }
+            return count;
+        }
+    }        // namespace
+
+    vma::vma() noexcept : vma(utils::default_shards) {}
+
+    vma::vma(size_t shard_count) noexcept : vma(shard_count, utils::default_size) {}
+
+    vma::vma(size_t shard_count, size_t reserve) noexcept : vma(shard_count, reserve, 0, 0, -1) {}
+
+    vma::vma(size_t shard_count, size_t reserve, size_t alignment, unsigned int rights, int key) noexcept
+      : vma(shard_count, reserve, alignment, rights, key, false)
+    {
+    }
+
+    vma::vma(size_t shard_count, size_t reserve, size_t alignment, unsigned int rights, int key, bool numa) noexcept
+      : vma(std::nothrow, shard_count, reserve, alignment, rights, key, numa)
+    {
+        if(!reserved())
+        {
+            fprintf(stderr, "[pkalloc]  cannot reserve %zu bytes: %s\n", reserve, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    vma::vma(std::nothrow_t, size_t shard_count, size_t reserve, size_t alignment, unsigned int rights, int key,
+             bool numa) noexcept
+      : region_start(nullptr), region_end(nullptr), size(0), pkey(-1), numa(false), node_count(1), node_span(reserve),
+        decay_ms(0), stop_purger(false), dirty_bytes(0), purged_bytes(0), backed_count(0), stop_populater(false)
     {
         using namespace utils;
 
+        // one shard per CPU unless told otherwise; shard ids must fit in the owner table
+        if(shard_count == 0)
+        {
+            shard_count = std::max(1U, std::thread::hardware_concurrency());
+        }
+        this->shard_count = std::min<size_t>(shard_count, pool_owner - max_nodes);
+
+        // one share of the region per NUMA node, as long as every share gets at least a page
+        std::fill(std::begin(node_index), std::end(node_index), -1);
+        node_ids[0] = 0;
+        if(numa)
+        {
+            auto nodes = allowed_nodes(node_ids);
+            if(nodes != 0 && reserve / min_alignment >= nodes)
+            {
+                this->numa = true;
+                node_count = nodes;
+            }
+        }
+        for(size_t n = 0; this->numa && n < node_count; ++n)
+        {
+            node_index[node_ids[n]] = static_cast<int8_t>(n);
+        }
+
+        // granules are a power of two, no larger than each shard's or node's share of the region
+        granule = shard_granule;
+        while(granule > min_alignment && granule > reserve / std::max(this->shard_count, node_count))
+        {
+            granule >>= 1U;
+        }
+        node_span = this->numa ? reserve / node_count / granule * granule : reserve;
+
+        // a metadata window for each shard and pool, placed directly below the data. The windows are reserved
+        // along with the rest of the region, so their pages are only backed once the list nodes reach them
+        auto meta_len = (this->shard_count + node_count) * metadata_size;
+
         int prot         = default_prot;
         int flags        = default_flags;
         int fd           = default_fd;
         ptrdiff_t offset = default_offset;
-        auto size_flag   = default_size + utils::default_alignment;
+        auto align       = std::max(granule, alignment);
+        auto size_flag   = meta_len + reserve + align;        // leave room to align the data
 
-        region_start = mmap(nullptr, size_flag, prot, flags, fd, offset);
-        if(region_start == MAP_FAILED)
+        auto base = mmap(nullptr, size_flag, prot, flags, fd, offset);
+        if(base == MAP_FAILED)
         {
-            fprintf(stderr, "mmap size_of_segment=%ld *fd=%d failed %s\n", size_flag, fd, strerror(errno));
-            exit(EXIT_FAILURE);
+            return;
+        }
+
+        // align the data, and give back the slack on either side
+        auto data_start = static_cast<char*>(get_aligned(static_cast<char*>(base) + meta_len, align));
+        auto meta_start = data_start - meta_len;
+        auto data_end   = data_start + reserve;
+        auto base_end   = static_cast<char*>(base) + size_flag;
+        if(meta_start > base)
+        {
+            munmap(base, meta_start - static_cast<char*>(base));
+        }
+        if(base_end > data_end)
+        {
+            munmap(data_end, base_end - data_end);
+        }
+
+        region_start = data_start;
+        region_end   = data_end;
+        size         = reserve;
+
+        // give read write protection to the metadata pages in the safe zone;
+        pkey = key != -1 ? key : pkey_alloc(0, 0);                           // allocate pkey from OS
+        pkey_mprotect(meta_start, meta_len + size, PROT_NONE, pkey);         // protect entire region w/ pkey
+        pkey_mprotect(meta_start, meta_len, PROT_READ | PROT_WRITE, pkey);        // enable read/write
+        if(!bind_pages(data_start, reserve))
+        {
+            fprintf(stderr, "[pkalloc]  cannot bind the region to its NUMA nodes: %s\n", strerror(errno));
         }
 
-        region_end            = static_cast<char*>(region_start) + size_flag;
-        size                  = size_flag;
-        auto new_region_start = static_cast<char*>(region_start) + utils::default_alignment;
+        // every granule starts out in its node's pool, and the shards start out empty
+        auto granule_count = (reserve + granule - 1) / granule;
+        owners.reset(new std::atomic<uint16_t>[granule_count]);
+        for(size_t i = 0; i < granule_count; ++i)
+        {
+            owners[i].store(pool_owner, std::memory_order_relaxed);
+        }
 
-        // give read write protection to the leading page in the safe zone;
-        pkey = pkey_alloc(0, 0);                                            // allocate pkey from OS
-        pkey_mprotect(region_start, size_flag, PROT_NONE, pkey);        // protect entire region w/ pkey
-        pkey_mprotect(region_start, utils::default_alignment, PROT_READ | PROT_WRITE, pkey);        // enable read/write
+        shards.reset(new shard[this->shard_count + node_count]());
+        for(size_t i = 0; i < this->shard_count; ++i)
+        {
+            shards[i].list.init(meta_start + i * metadata_size, metadata_size, data_start, data_start);
+        }
+        for(size_t n = 0; n < node_count; ++n)
+        {
+            auto& pool  = shards[pool_of(n)];
+            auto first  = data_start + n * node_span;
+            auto last   = n + 1 == node_count ? data_end : first + node_span;
+            pool.list.init(meta_start + pool_of(n) * metadata_size, metadata_size, first, last);
+            pool.granules = (static_cast<size_t>(last - first) + granule - 1) / granule;
+        }
+        usage.reset(new node_usage[node_count]());
 
-        // initialize the freelist with the adjusted region
-        list.init(region_start, region_end);
+        if(default_decay_ms != 0)
+        {
+            set_purge_decay(std::chrono::milliseconds(default_decay_ms));
+        }
 
-        // don't give  the underlying request our page for internal use
-        // (advances the region start pointer past our reserved 1 page allocation)
-        region_start = new_region_start;
+        // only restrict access once the metadata has been written
+        if(rights != 0 && pkey != -1)
+        {
+            pkru::shadow::set(pkey, rights);
+        }
     }
 
     vma::~vma() noexcept
     {
-        pkey_set(pkey, 0x0);
-        auto avail = list.mem_available();
+        if(!reserved())
+        {
+            return;
+        }
+        stop_populating();
+        stop_purging();
+        if(pkey != -1)
+        {
+            pkru::shadow::set(pkey, 0x0);
+        }
+        ptrdiff_t avail = 0;
+        for(size_t i = 0; i < shard_count + node_count; ++i)
+        {
+            avail += shards[i].list.mem_available();
+        }
         auto mem = size - avail;
-        std::cout << "[pkalloc]  Used "<< mem/4096 <<" of "<< size/4096 <<" pages\n"; 
-        list.release_freelist();
+        std::cout << "[pkalloc]  Used "<< mem/4096 <<" of "<< size/4096 <<" pages\n";
+        for(size_t i = 0; i < shard_count + node_count; ++i)
+        {
+            shards[i].list.release_freelist();
+        }
+    }
+
+    bool vma::reserved() const noexcept
+    {
+        return region_start != nullptr;
     }
 
     void* vma::map_region(void* addr, size_t length, int prot, int flags, int fd, ptrdiff_t offset) noexcept
     {
-        auto pages = list.request(addr, length, utils::default_alignment);
+        void* pages = nullptr;
+        if(addr)
+        {
+            // fixed requests can only be satisfied by the list that owns the address
+            if(is_safe_addr(addr))
+            {
+                pages = shard_request(owner_of(addr), addr, length);
+            }
+        }
+        else
+        {
+            pages = allocate(length);
+        }
+
         if(pages == nullptr || pages == MAP_FAILED)
         {
             return MAP_FAILED;
         }
 
+        // a file or shared memory takes the place of the reserved pages, keeping the region inside the reservation
+        auto is_backed_map = fd != -1 || (flags & MAP_SHARED) != 0;
+        if(is_backed_map && !attach(pages, length, prot, flags, fd, offset))
+        {
+            return MAP_FAILED;
+        }
+
         auto err = pkey_mprotect(pages, length, prot, pkey);
         if(err == -1)
         {
-            list.return_region(addr, length);
+            if(is_backed_map)
+            {
+                bool deferred = false;
+                decommit(pages, length, deferred, err);
+            }
+            return_pages(pages, length);
+            return MAP_FAILED;
+        }
+        track(pages, length, true);
+
+        // MAP_NONBLOCK only skips read-ahead for mmap(); here it keeps the caller from waiting for the faults
+        if((flags & MAP_POPULATE) != 0)
+        {
+            populate(pages, length, prot, (flags & MAP_NONBLOCK) != 0);
+        }
+        return pages;
+    }
+
+    void* vma::map_region_on_node(int node, size_t length, int prot) noexcept
+    {
+        if(!numa || node < 0 || node >= static_cast<int>(max_nodes) || node_index[node] < 0 || length == 0)
+        {
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+
+        auto pages = pool_request(static_cast<size_t>(node_index[node]), length, utils::default_alignment);
+        if(pages == nullptr)
+        {
+            errno = ENOMEM;
+            return MAP_FAILED;
+        }
+
+        if(pkey_mprotect(pages, length, prot, pkey) == -1)
+        {
+            auto err = errno;
+            return_pages(pages, length);
+            errno = err;
+            return MAP_FAILED;
+        }
+        track(pages, length, true);
+        return pages;
+    }
+
+    void* vma::aligned_map_region(size_t length, size_t alignment, int prot, int flags) noexcept
+    {
+        if(length == 0 || (alignment & (alignment - 1)) != 0 || (flags & ~(map_hugepage | map_populate)) != 0)
+        {
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+
+        auto pages = allocate(length, std::max(alignment, utils::min_alignment));
+        if(pages == nullptr)
+        {
+            errno = ENOMEM;
+            return MAP_FAILED;
+        }
+
+        if(pkey_mprotect(pages, length, prot, pkey) == -1)
+        {
+            return_pages(pages, length);
             return MAP_FAILED;
         }
+
+        // only a hint: the kernel may not have transparent huge pages enabled
+        if((flags & map_hugepage) != 0)
+        {
+            madvise(pages, length, MADV_HUGEPAGE);
+        }
+        track(pages, length, true);
+
+        // populated after the huge page hint, so the faults can already use huge pages
+        if((flags & map_populate) != 0)
+        {
+            populate(pages, length, prot, false);
+        }
         return pages;
     }
 
+    void* vma::remap_region(void* addr, size_t old_length, size_t new_length, int flags) noexcept
+    {
+        using namespace utils;
+        auto begin   = static_cast<char*>(addr);
+        auto old_len = get_aligned_size(old_length, min_alignment);
+        auto new_len = get_aligned_size(new_length, min_alignment);
+        if(begin < region_start || begin >= region_end || old_length == 0 || new_length == 0 ||
+           old_len > static_cast<size_t>(static_cast<char*>(region_end) - begin) ||
+           addr != get_aligned(addr, min_alignment) || (flags & ~remap_maymove) != 0)
+        {
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+
+        if(new_len == old_len)
+        {
+            return addr;
+        }
+
+        if(new_len < old_len)
+        {
+            return unmap_region(begin + new_len, old_len - new_len) == -1 ? MAP_FAILED : addr;
+        }
+
+        // a backed region would have to map more of its file, which only mremap() does, and only over unmapped pages
+        if(is_backed(begin, old_len))
+        {
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+
+        if(grow_in_place(begin, old_len, new_len))
+        {
+            return addr;
+        }
+
+        if((flags & remap_maymove) == 0)
+        {
+            errno = ENOMEM;
+            return MAP_FAILED;
+        }
+        return move_region(begin, old_len, new_len);
+    }
+
     int vma::unmap_region(void* addr, size_t length) noexcept
     {
         using namespace utils;
-        auto res = mmap(addr, length, PROT_NONE, default_flags | MAP_FIXED, default_fd, default_offset);
-        if(res == MAP_FAILED)
+        auto begin = static_cast<char*>(addr);
+        if(begin < region_start || begin + length > region_end || length == 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        int err;
+        auto deferred = decay_ms.load(std::memory_order_relaxed) != 0;
+        if(!decommit(addr, length, deferred, err))
+        {
+            return -1;
+        }
+        track(addr, length, false);
+
+        auto idx = owner_of(addr);
+        {
+            std::lock_guard<std::mutex> guard(shards[idx].lock);
+            shards[idx].list.return_region(addr, length);        // reinsert region into its owner's freelist;
+        }
+
+        if(idx < shard_count)
+        {
+            release_granules(idx, addr, length);
+        }
+
+        if(deferred)
+        {
+            queue_dirty(addr, length);
+        }
+
+        if(err != 0)
         {
+            errno = err;
             return -1;
         }
+        return 0;
+    }
+
+    size_t vma::map_regions(region_request* regions, size_t count, int prot) noexcept
+    {
+        // serve what we can from the home shard while holding its lock once
+        auto& home = shards[home_shard()];
+        {
+            std::lock_guard<std::mutex> guard(home.lock);
+            for(size_t i = 0; i < count; ++i)
+            {
+                auto& r = regions[i];
+                r.err   = 0;
+                r.addr  = nullptr;
+                if(r.length != 0 && r.length < granule)
+                {
+                    r.addr = home.list.request(nullptr, r.length, utils::default_alignment);
+                }
+            }
+        }
+
+        // everything else takes the single request path, which may claim or steal granules
+        std::vector<region_request*> mapped;
+        mapped.reserve(count);
+        for(size_t i = 0; i < count; ++i)
+        {
+            auto& r = regions[i];
+            if(!r.addr && r.length != 0)
+            {
+                r.addr = allocate(r.length);
+            }
+
+            if(!r.addr || r.addr == MAP_FAILED)
+            {
+                r.addr = MAP_FAILED;
+                r.err  = r.length == 0 ? EINVAL : ENOMEM;
+                continue;
+            }
+            mapped.push_back(&r);
+        }
+
+        std::sort(mapped.begin(), mapped.end(), by_address);
+
+        // protect each run of adjacent regions at once, and only look at the elements of a run if that fails
+        size_t done = 0;
+        for(size_t first = 0, last = 0; first < mapped.size(); first = last)
+        {
+            auto run_end = pages_end(*mapped[first]);
+            for(last = first + 1; last < mapped.size() && mapped[last]->addr == run_end; ++last)
+            {
+                run_end = pages_end(*mapped[last]);
+            }
+
+            auto run_start = static_cast<char*>(mapped[first]->addr);
+            if(pkey_mprotect(run_start, run_end - run_start, prot, pkey) == 0)
+            {
+                track(run_start, static_cast<size_t>(run_end - run_start), true);
+                done += last - first;
+                continue;
+            }
+
+            for(auto i = first; i < last; ++i)
+            {
+                auto& r = *mapped[i];
+                if(pkey_mprotect(r.addr, r.length, prot, pkey) == 0)
+                {
+                    track(r.addr, r.length, true);
+                    done++;
+                    continue;
+                }
+                r.err = errno;
+                return_pages(r.addr, r.length);
+                r.addr = MAP_FAILED;
+            }
+        }
+        return done;
+    }
+
+    size_t vma::unmap_regions(region_request* regions, size_t count) noexcept
+    {
+        std::vector<region_request*> pending;
+        pending.reserve(count);
+        for(size_t i = 0; i < count; ++i)
+        {
+            auto& r   = regions[i];
+            auto addr = static_cast<char*>(r.addr);
+            r.err     = 0;
+            if(addr < region_start || addr >= region_end || r.length == 0 ||
+               r.length > static_cast<size_t>(static_cast<char*>(region_end) - addr) ||
+               r.addr != utils::get_aligned(r.addr, utils::min_alignment))
+            {
+                r.err = EINVAL;
+                continue;
+            }
+            pending.push_back(&r);
+        }
+
+        std::sort(pending.begin(), pending.end(), by_address);
+
+        // group adjacent regions with the same owner into runs. Overlapping regions would return pages twice
+        struct run
+        {
+            size_t first;
+            size_t last;
+            size_t owner;
+            bool deferred;        // the pages are purged later, as backed regions never are
+        };
+        std::vector<run> runs;
+        std::vector<region_request*> valid;
+        valid.reserve(pending.size());
+        char* prev_end = nullptr;
+        auto deferred  = decay_ms.load(std::memory_order_relaxed) != 0;
+        for(auto r : pending)
+        {
+            if(static_cast<char*>(r->addr) < prev_end)
+            {
+                r->err = EINVAL;
+                continue;
+            }
+
+            auto owner = owner_of(r->addr);
+            if(runs.empty() || r->addr != prev_end || runs.back().owner != owner)
+            {
+                runs.push_back({valid.size(), valid.size(), owner, deferred});
+            }
+            valid.push_back(r);
+            runs.back().last = valid.size();
+            prev_end         = pages_end(*r);
+        }
+
+        // discard the contents and revoke access, outside any lock. A run that cannot be replaced is retried one
+        // element at a time, so a single bad region does not fail its neighbors
+        auto scrub = [this](region_request** first, region_request** last, bool& deferred) {
+            auto start = static_cast<char*>((*first)->addr);
+            auto len   = static_cast<size_t>(pages_end(*last[-1]) - start);
+            int err;
+            if(!decommit(start, len, deferred, err))
+            {
+                return false;
+            }
+
+            // the pages are unmapped regardless, just as in unmap_region()
+            if(err != 0)
+            {
+                std::for_each(first, last, [err](region_request* r) { r->err = err; });
+            }
+            return true;
+        };
+
+        std::vector<run> scrubbed;
+        scrubbed.reserve(runs.size());
+        for(auto& curr : runs)
+        {
+            if(scrub(valid.data() + curr.first, valid.data() + curr.last, curr.deferred))
+            {
+                scrubbed.push_back(curr);
+                continue;
+            }
+
+            if(curr.last - curr.first == 1)
+            {
+                valid[curr.first]->err = errno;
+                continue;
+            }
+
+            for(auto i = curr.first; i < curr.last; ++i)
+            {
+                run single = {i, i + 1, curr.owner, deferred};
+                if(scrub(valid.data() + i, valid.data() + i + 1, single.deferred))
+                {
+                    scrubbed.push_back(single);
+                    continue;
+                }
+                valid[i]->err = errno;
+            }
+        }
+
+        // return the runs to their owners, holding each owner's lock across consecutive runs
+        std::unique_lock<std::mutex> guard;
+        size_t held = shard_count + node_count;
+        for(auto& curr : scrubbed)
+        {
+            if(curr.owner != held)
+            {
+                guard = std::unique_lock<std::mutex>(shards[curr.owner].lock);
+                held  = curr.owner;
+            }
+            auto start = static_cast<char*>(valid[curr.first]->addr);
+            shards[curr.owner].list.return_region(start, pages_end(*valid[curr.last - 1]) - start);
+        }
+        if(guard.owns_lock())
+        {
+            guard.unlock();
+        }
+
+        for(auto& curr : scrubbed)
+        {
+            auto start  = static_cast<char*>(valid[curr.first]->addr);
+            auto length = static_cast<size_t>(pages_end(*valid[curr.last - 1]) - start);
+            track(start, length, false);
+            if(curr.owner < shard_count)
+            {
+                release_granules(curr.owner, start, length);
+            }
+
+            if(curr.deferred)
+            {
+                queue_dirty(start, length);
+            }
+        }
 
-        auto err =
-          pkey_mprotect(addr, length, PROT_NONE, pkey);        // remove permissions before returning to freelist
-        list.return_region(addr, length);                      // reinsert region into freelist;
-        return err;
+        return static_cast<size_t>(std::count_if(regions, regions + count, [](const region_request& r) {
+            return r.err == 0;
+        }));
     }
 
     int vma::get_pkey() noexcept
@@ -106,16 +694,847 @@ namespace alloc
         return pkey;
     }
 
-    bool vma::is_safe_addr(void* addr) noexcept
+    void vma::populate(void* addr, size_t length, int prot, bool background) noexcept
     {
-        return (addr >= region_start) && (addr <= region_end);
+        if((prot & (PROT_READ | PROT_WRITE)) == 0 || length == 0)
+        {
+            return;
+        }
+
+        // touching pages from another thread could fault on a region unmapped in the meantime, so only the kernel
+        // may populate in the background
+        if(!background || populate_advice.load(std::memory_order_relaxed) != support::yes)
+        {
+            populate_now(addr, length, prot);
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard(populate_lock);
+        if(!populater.joinable())
+        {
+            stop_populater = false;
+            populater      = std::thread(&vma::populate_loop, this);
+        }
+        to_populate.push_back({addr, length, prot});
+        populate_wake.notify_one();
     }
-    
-    void vma::print_mem() noexcept
+
+    void vma::populate_now(void* addr, size_t length, int prot) noexcept
     {
-        pkey_set(pkey, 0x0);
-        auto avail = list.mem_available();
-        auto mem = size - avail;
-        std::cout << "[pkalloc]  Used "<< mem/4096 <<" of "<< size/4096 <<" pages\n";
+        auto len   = utils::get_aligned_size(length, utils::min_alignment);
+        auto state = populate_advice.load(std::memory_order_relaxed);
+#if defined(MADV_POPULATE_READ) && defined(MADV_POPULATE_WRITE)
+        auto advice = (prot & PROT_WRITE) != 0 ? MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+        if(state != support::no)
+        {
+            // once the advice has worked, a failure means the region went away, not that the kernel lacks it
+            if(madvise(addr, len, advice) == 0)
+            {
+                state = support::yes;
+            }
+            else if(errno == EINVAL && state == support::unknown)
+            {
+                state = support::no;
+            }
+            populate_advice.store(state, std::memory_order_relaxed);
+        }
+#endif
+
+        if(state == support::no)
+        {
+            touch_pages(addr, len, prot);
+        }
+    }
+
+    void vma::populate_loop() noexcept
+    {
+        // the kernel checks the pkey's rights as it faults pages in
+        if(pkey != -1)
+        {
+            pkru::shadow::set(pkey, 0x0);
+        }
+
+        std::unique_lock<std::mutex> guard(populate_lock);
+        while(!stop_populater)
+        {
+            if(to_populate.empty())
+            {
+                populate_wake.wait(guard);
+                continue;
+            }
+
+            auto next = to_populate.front();
+            to_populate.pop_front();
+            guard.unlock();
+            populate_now(next.addr, next.length, next.prot);
+            guard.lock();
+        }
+    }
+
+    void vma::stop_populating() noexcept
+    {
+        {
+            std::lock_guard<std::mutex> guard(populate_lock);
+            if(!populater.joinable())
+            {
+                return;
+            }
+            stop_populater = true;
+        }
+        populate_wake.notify_one();
+        populater.join();
+    }
+
+    bool vma::is_backed(void* addr, size_t length) noexcept
+    {
+        if(backed_count.load(std::memory_order_acquire) == 0)
+        {
+            return false;
+        }
+
+        auto begin = static_cast<char*>(addr);
+        auto end   = begin + length;
+        std::lock_guard<std::mutex> guard(backed_lock);
+        auto next = backed.upper_bound(begin);
+        if(next != backed.begin() && std::prev(next)->second > begin)
+        {
+            return true;
+        }
+        return next != backed.end() && next->first < end;
+    }
+
+    size_t vma::numa_nodes() const noexcept
+    {
+        return node_count;
+    }
+
+    size_t vma::get_node_stats(node_stats* stats, size_t count) noexcept
+    {
+        if(!numa)
+        {
+            return 0;
+        }
+
+        for(size_t n = 0; n < std::min(count, node_count); ++n)
+        {
+            stats[n].node     = node_ids[n];
+            stats[n].reserved = n + 1 == node_count ? size - n * node_span : node_span;
+            stats[n].mapped   = usage[n].mapped.load(std::memory_order_relaxed);
+            stats[n].misses   = usage[n].misses.load(std::memory_order_relaxed);
+        }
+        return node_count;
+    }
+
+    bool vma::is_safe_addr(void* addr) noexcept
+    {
+        return classify::contains(safe_begin(), safe_end(), addr);
+    }
+
+    bool vma::is_safe_range(void* addr, size_t length) noexcept
+    {
+        return classify::contains_range(safe_begin(), safe_end(), addr, length);
+    }
+
+    size_t vma::classify_pointers(const void* const* ptrs, size_t count, uint8_t* out) noexcept
+    {
+        return classify::pointers(safe_begin(), safe_end(), ptrs, count, out);
+    }
+
+    uintptr_t vma::safe_begin() const noexcept
+    {
+        return reinterpret_cast<uintptr_t>(region_start);
+    }
+
+    uintptr_t vma::safe_end() const noexcept
+    {
+        return reinterpret_cast<uintptr_t>(region_end);
+    }
+    
+    void vma::print_mem() noexcept
+    {
+        // called from signal handlers, which run with their own PKRU and must leave the shadow alone
+        if(pkey != -1)
+        {
+            pkru::write(pkru::with_rights(pkru::read(), pkey, 0x0));
+        }
+        ptrdiff_t avail = 0;
+        for(size_t i = 0; i < shard_count + node_count; ++i)
+        {
+            std::lock_guard<std::mutex> guard(shards[i].lock);
+            avail += shards[i].list.mem_available();
+        }
+        auto mem = size - avail;
+        std::cout << "[pkalloc]  Used "<< mem/4096 <<" of "<< size/4096 <<" pages\n";
+    }
+
+    void vma::get_stats(vma_stats& stats) noexcept
+    {
+        stats          = vma_stats();
+        stats.reserved = size;
+        for(size_t i = 0; i < shard_count + node_count; ++i)
+        {
+            std::lock_guard<std::mutex> guard(shards[i].lock);
+            stats.free += shards[i].list.mem_available();
+            stats.extents += shards[i].list.extent_count();
+            stats.largest_free = std::max(stats.largest_free, shards[i].list.largest_extent());
+        }
+        stats.dirty  = dirty_bytes.load(std::memory_order_relaxed);
+        stats.purged = purged_bytes.load(std::memory_order_relaxed);
+    }
+
+    size_t vma::granule_index(void* addr) noexcept
+    {
+        return static_cast<size_t>(static_cast<char*>(addr) - static_cast<char*>(region_start)) / granule;
+    }
+
+    size_t vma::owner_of(void* addr) noexcept
+    {
+        auto owner = owners[granule_index(addr)].load(std::memory_order_acquire);
+        return owner == pool_owner ? pool_of(node_of(addr)) : owner;
+    }
+
+    size_t vma::home_shard() noexcept
+    {
+        auto cpu = sched_getcpu();
+        if(cpu < 0)
+        {
+            // fall back to spreading threads round robin
+            static std::atomic<size_t> thread_count(0);
+            thread_local size_t thread_id = thread_count++;
+            return thread_id % shard_count;
+        }
+        return static_cast<size_t>(cpu) % shard_count;
+    }
+
+    size_t vma::pool_of(size_t node) const noexcept
+    {
+        return shard_count + node;
+    }
+
+    size_t vma::node_of(void* addr) const noexcept
+    {
+        if(!numa)
+        {
+            return 0;
+        }
+        auto offset = static_cast<size_t>(static_cast<char*>(addr) - static_cast<char*>(region_start));
+        return std::min(offset / node_span, node_count - 1);
+    }
+
+    size_t vma::local_node() const noexcept
+    {
+        unsigned int cpu  = 0;
+        unsigned int node = 0;
+        if(!numa || getcpu(&cpu, &node) != 0 || node >= max_nodes || node_index[node] < 0)
+        {
+            return 0;
+        }
+        return static_cast<size_t>(node_index[node]);
+    }
+
+    char* vma::share_end(char* addr, char* end) const noexcept
+    {
+        auto node = node_of(addr);
+        if(node + 1 == node_count)
+        {
+            return end;
+        }
+        return std::min(end, static_cast<char*>(region_start) + (node + 1) * node_span);
+    }
+
+    bool vma::bind_pages(void* addr, size_t length) noexcept
+    {
+        auto curr  = static_cast<char*>(addr);
+        auto end   = curr + utils::get_aligned_size(length, utils::min_alignment);
+        bool bound = true;
+        while(numa && curr < end)
+        {
+            // the kernel reads one bit less than the mask size it is given
+            auto next          = share_end(curr, end);
+            unsigned long mask = 1UL << static_cast<unsigned int>(node_ids[node_of(curr)]);
+            bound = syscall(SYS_mbind, curr, next - curr, MPOL_BIND, &mask, max_nodes + 1, 0) == 0 && bound;
+            curr  = next;
+        }
+        return bound;
+    }
+
+    void vma::track(void* addr, size_t length, bool mapped) noexcept
+    {
+        auto curr = static_cast<char*>(addr);
+        auto end  = curr + utils::get_aligned_size(length, utils::min_alignment);
+        while(numa && curr < end)
+        {
+            auto next     = share_end(curr, end);
+            auto& counter = usage[node_of(curr)].mapped;
+            auto bytes    = static_cast<size_t>(next - curr);
+            if(mapped)
+            {
+                counter.fetch_add(bytes, std::memory_order_relaxed);
+            }
+            else
+            {
+                counter.fetch_sub(bytes, std::memory_order_relaxed);
+            }
+            curr = next;
+        }
+    }
+
+    void* vma::pool_request(size_t node, size_t length, size_t align) noexcept
+    {
+        auto pages = shard_request(pool_of(node), nullptr, length, align);
+        if(!pages && reclaim_granules())
+        {
+            pages = shard_request(pool_of(node), nullptr, length, align);
+        }
+        return pages;
+    }
+
+    void* vma::allocate(size_t length, size_t align) noexcept
+    {
+        auto node   = local_node();
+        void* pages = nullptr;
+
+        // a shard's extents never span more than the granules it owns, so larger requests go to the pools
+        if(length >= granule || align > granule)
+        {
+            pages = pool_request(node, length, align);
+
+            // the local node's share is full, so spill onto the others
+            for(size_t i = 1; !pages && i < node_count; ++i)
+            {
+                pages = shard_request(pool_of((node + i) % node_count), nullptr, length, align);
+            }
+        }
+        else
+        {
+            auto home = home_shard();
+            pages     = shard_request(home, nullptr, length, align);
+            if(!pages && claim_granule(home, node))
+            {
+                pages = shard_request(home, nullptr, length, align);
+            }
+
+            // no whole granule is free anywhere, so borrow space from whichever list has it
+            auto lists = shard_count + node_count;
+            for(size_t i = 1; !pages && i < lists; ++i)
+            {
+                pages = shard_request((home + i) % lists, nullptr, length, align);
+            }
+        }
+
+        if(numa && pages && node_of(pages) != node)
+        {
+            usage[node].misses.fetch_add(1, std::memory_order_relaxed);
+        }
+        return pages;
+    }
+
+    void vma::return_pages(void* addr, size_t length) noexcept
+    {
+        auto& owner = shards[owner_of(addr)];
+        std::lock_guard<std::mutex> guard(owner.lock);
+        owner.list.return_region(addr, length);
+    }
+
+    bool vma::grow_in_place(char* addr, size_t old_length, size_t new_length) noexcept
+    {
+        auto tail  = addr + old_length;
+        auto extra = new_length - old_length;
+        if(extra > static_cast<size_t>(static_cast<char*>(region_end) - tail))
+        {
+            return false;
+        }
+
+        // the tail must be free in the list that owns the region, which also keeps the region in that list's granules
+        if(shard_request(owner_of(addr), tail, extra) != tail)
+        {
+            return false;
+        }
+
+        // moving the region's first page onto the tail and back leaves an empty copy of it there, with the region's
+        // protections and pkey. The tail is replaced, never unmapped, so no other mapping can take it
+        auto page = utils::min_alignment;
+        if(!copy_mapping(addr, page, tail))
+        {
+            return_pages(tail, extra);
+            return false;
+        }
+
+        if(!copy_mapping(tail, page, addr))
+        {
+            if(move_back(tail, addr, page))
+            {
+                return_pages(tail, extra);
+            }
+            else
+            {
+                return_pages(tail + page, extra - page);
+            }
+            return false;
+        }
+
+        if(!clone_mapping(tail, page, tail + page, extra - page))
+        {
+            if(reset_pages(tail, extra))
+            {
+                return_pages(tail, extra);
+            }
+            return false;
+        }
+
+        // the tail takes on the region's memory policy, which belongs to another node if it crosses into one
+        bind_pages(tail, extra);
+        track(tail, extra, true);
+        return true;
+    }
+
+    void* vma::move_region(char* addr, size_t old_length, size_t new_length) noexcept
+    {
+        auto target = static_cast<char*>(allocate(new_length));
+        if(target == nullptr)
+        {
+            errno = ENOMEM;
+            return MAP_FAILED;
+        }
+
+        // the kernel moves the page tables, so the contents, protections and pkey all come along without a copy. The
+        // old range stays mapped, emptied, and lends the rest of the target the same protections and pkey
+        if(!copy_mapping(addr, old_length, target))
+        {
+            auto err = errno;
+            return_pages(target, new_length);
+            errno = err;
+            return MAP_FAILED;
+        }
+
+        auto extra = new_length - old_length;
+        if(!clone_mapping(addr, old_length, target + old_length, extra))
+        {
+            auto err = errno;
+            auto tail_reset = reset_pages(target + old_length, extra);
+            if(move_back(target, addr, old_length) && tail_reset)
+            {
+                return_pages(target, new_length);
+            }
+            else if(tail_reset)
+            {
+                return_pages(target + old_length, extra);
+            }
+            errno = err;
+            return MAP_FAILED;
+        }
+
+        // the pages' memory policy moves along too, and may belong to another node
+        bind_pages(target, new_length);
+        track(target, new_length, true);
+        track(addr, old_length, false);
+
+        auto idx = owner_of(addr);
+        if(reset_pages(addr, old_length))
+        {
+            return_pages(addr, old_length);
+            if(idx < shard_count)
+            {
+                release_granules(idx, addr, old_length);
+            }
+        }
+        return target;
+    }
+
+    bool vma::copy_mapping(void* from, size_t length, void* to) noexcept
+    {
+        return mremap(from, length, length, MREMAP_MAYMOVE | MREMAP_FIXED | MREMAP_DONTUNMAP, to) != MAP_FAILED;
+    }
+
+    bool vma::clone_mapping(char* from, size_t from_length, char* to, size_t length) noexcept
+    {
+        // every copy doubles the empty pages to copy from, so a large tail takes a logarithmic number of calls
+        size_t done = 0;
+        while(done < length)
+        {
+            auto chunk = std::min(done == 0 ? from_length : done, length - done);
+            if(!copy_mapping(done == 0 ? from : to, chunk, to + done))
+            {
+                return false;
+            }
+            done += chunk;
+        }
+        return true;
+    }
+
+    bool vma::move_back(char* from, char* to, size_t length) noexcept
+    {
+        using namespace utils;
+        if(copy_mapping(from, length, to))
+        {
+            return reset_pages(from, length);
+        }
+
+        // the kernel refused to keep the source mapped, so the contents go back the plain way, and the source is
+        // mapped again unless another mapping took it in between. Only a kernel out of memory gets here
+        if(mremap(from, length, length, MREMAP_MAYMOVE | MREMAP_FIXED, to) == MAP_FAILED)
+        {
+            return false;
+        }
+
+        auto res = mmap(from, length, PROT_NONE, default_flags | MAP_FIXED_NOREPLACE, default_fd, default_offset);
+        if(res != from)
+        {
+            if(res != MAP_FAILED)
+            {
+                munmap(res, length);
+            }
+            return false;
+        }
+        bind_pages(from, length);
+        return pkey_mprotect(from, length, PROT_NONE, pkey) == 0;
+    }
+
+    bool vma::reset_pages(void* addr, size_t length) noexcept
+    {
+        using namespace utils;
+
+        // MAP_FIXED swaps in fresh reserved pages in one step, so the range is never unmapped in between
+        if(mmap(addr, length, PROT_NONE, default_flags | MAP_FIXED, default_fd, default_offset) != addr)
+        {
+            return false;
+        }
+        bind_pages(addr, length);
+        return pkey_mprotect(addr, length, PROT_NONE, pkey) == 0;
+    }
+
+    void* vma::shard_request(size_t idx, void* addr, size_t length, size_t align) noexcept
+    {
+        std::lock_guard<std::mutex> guard(shards[idx].lock);
+        return shards[idx].list.request(addr, length, align);
+    }
+
+    bool vma::claim_granule(size_t idx, size_t node) noexcept
+    {
+        void* claimed = shard_request_granule(pool_of(node));
+
+        // the node's pool is dry, so try the other nodes' pools, then steal a free granule from the nearest neighbor
+        for(size_t i = 1; !claimed && i < node_count; ++i)
+        {
+            claimed = shard_request_granule(pool_of((node + i) % node_count));
+        }
+        for(size_t i = 1; !claimed && i < shard_count; ++i)
+        {
+            claimed = shard_request_granule((idx + i) % shard_count);
+        }
+
+        if(!claimed)
+        {
+            return false;
+        }
+
+        owners[granule_index(claimed)].store(static_cast<uint16_t>(idx), std::memory_order_release);
+        auto& home = shards[idx];
+        std::lock_guard<std::mutex> guard(home.lock);
+        home.list.return_region(claimed, granule);
+        home.granules++;
+        return true;
+    }
+
+    void* vma::shard_request_granule(size_t idx) noexcept
+    {
+        auto& victim = shards[idx];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        auto claimed = victim.list.request(nullptr, granule, granule);
+        if(claimed)
+        {
+            victim.granules--;
+        }
+        return claimed;
+    }
+
+    bool vma::reclaim_granules() noexcept
+    {
+        // pull every completely free granule back from the shards, so they can form larger extents in the pools
+        bool reclaimed = false;
+        for(size_t i = 0; i < shard_count; ++i)
+        {
+            for(auto curr = shard_request_granule(i); curr != nullptr; curr = shard_request_granule(i))
+            {
+                auto& pool = shards[pool_of(node_of(curr))];
+                owners[granule_index(curr)].store(pool_owner, std::memory_order_release);
+                std::lock_guard<std::mutex> guard(pool.lock);
+                pool.list.return_region(curr, granule);
+                pool.granules++;
+                reclaimed = true;
+            }
+        }
+        return reclaimed;
+    }
+
+    void vma::release_granules(size_t idx, void* addr, size_t length) noexcept
+    {
+        auto& home = shards[idx];
+        auto first = static_cast<char*>(region_start) + granule_index(addr) * granule;
+        auto last  = static_cast<char*>(addr) + length;
+
+        // hand any granule left completely free back to the pool, but keep one around to avoid thrashing
+        for(auto curr = first; curr < last; curr += granule)
+        {
+            {
+                std::lock_guard<std::mutex> guard(home.lock);
+                auto node = home.list.search(curr);
+                if(home.granules <= 1 || !node || node->start > curr || curr + granule > node->end)
+                {
+                    continue;
+                }
+                home.list.remove(curr, granule);
+                home.granules--;
+            }
+
+            auto& pool = shards[pool_of(node_of(curr))];
+            owners[granule_index(curr)].store(pool_owner, std::memory_order_release);
+            std::lock_guard<std::mutex> guard(pool.lock);
+            pool.list.return_region(curr, granule);
+            pool.granules++;
+        }
+    }
+
+    bool vma::decommit(void* addr, size_t length, bool& deferred, int& err) noexcept
+    {
+        using namespace utils;
+        err = 0;
+
+        // replace the pages with fresh ones, unless the purger will take care of them later. Backed pages must be
+        // replaced now, as the purger would only discard them, leaving the file or shared memory mapped
+        auto backed_pages = is_backed(addr, length);
+        deferred          = deferred && !backed_pages;
+        if(!deferred)
+        {
+            if(mmap(addr, length, PROT_NONE, default_flags | MAP_FIXED, default_fd, default_offset) == MAP_FAILED)
+            {
+                return false;
+            }
+
+            // fresh pages come with the default memory policy
+            bind_pages(addr, length);
+            if(backed_pages)
+            {
+                forget_backed(addr, length);
+            }
+        }
+
+        // remove permissions before returning to freelist
+        if(pkey_mprotect(addr, length, PROT_NONE, pkey) == -1)
+        {
+            err = errno;
+        }
+        return true;
+    }
+
+    bool vma::attach(void* addr, size_t length, int prot, int flags, int fd, ptrdiff_t offset) noexcept
+    {
+        auto sharing = (flags & MAP_SHARED) != 0 ? MAP_SHARED : MAP_PRIVATE;
+        auto source  = fd == -1 ? MAP_ANONYMOUS : 0;
+        if(mmap(addr, length, prot, sharing | source | MAP_FIXED, fd, offset) != MAP_FAILED)
+        {
+            add_backed(addr, length);
+            return true;
+        }
+
+        // the kernel may have unmapped the reserved pages before failing, so put fresh ones back
+        auto err      = errno;
+        bool deferred = false;
+        int ignored;
+        if(decommit(addr, length, deferred, ignored))
+        {
+            return_pages(addr, length);
+        }
+        errno = err;
+        return false;
+    }
+
+    void vma::add_backed(void* addr, size_t length) noexcept
+    {
+        auto begin = static_cast<char*>(addr);
+        std::lock_guard<std::mutex> guard(backed_lock);
+        backed[begin] = begin + utils::get_aligned_size(length, utils::min_alignment);
+        backed_count.store(backed.size(), std::memory_order_release);
+    }
+
+    void vma::forget_backed(void* addr, size_t length) noexcept
+    {
+        auto begin = static_cast<char*>(addr);
+        auto end   = begin + utils::get_aligned_size(length, utils::min_alignment);
+        std::lock_guard<std::mutex> guard(backed_lock);
+
+        // the first region that may overlap starts at or before begin
+        auto curr = backed.upper_bound(begin);
+        if(curr != backed.begin())
+        {
+            --curr;
+        }
+
+        // drop every overlapping region, keeping the parts of it outside [begin, end)
+        while(curr != backed.end() && curr->first < end)
+        {
+            auto first = curr->first;
+            auto last  = curr->second;
+            if(last <= begin)
+            {
+                ++curr;
+                continue;
+            }
+
+            curr = backed.erase(curr);
+            if(first < begin)
+            {
+                backed[first] = begin;
+            }
+            if(last > end)
+            {
+                backed[end] = last;
+            }
+        }
+        backed_count.store(backed.size(), std::memory_order_release);
+    }
+
+    void vma::queue_dirty(void* addr, size_t length) noexcept
+    {
+        auto len = utils::get_aligned_size(length, utils::min_alignment);
+        std::lock_guard<std::mutex> guard(purge_lock);
+        dirty.push_back({static_cast<char*>(addr), len, std::chrono::steady_clock::now()});
+        dirty_bytes.store(dirty_bytes.load(std::memory_order_relaxed) + len, std::memory_order_relaxed);
+    }
+
+    void vma::set_purge_decay(std::chrono::milliseconds decay) noexcept
+    {
+        if(decay.count() <= 0)
+        {
+            // unmaps go back to scrubbing inline, so only the pages already queued need purging
+            decay_ms.store(0, std::memory_order_relaxed);
+            stop_purging();
+            purge_all();
+            return;
+        }
+
+        decay_ms.store(decay.count(), std::memory_order_relaxed);
+        std::lock_guard<std::mutex> guard(purge_lock);
+        if(!purger.joinable())
+        {
+            stop_purger = false;
+            purger      = std::thread(&vma::purge_loop, this);
+        }
+        purge_wake.notify_one();
+    }
+
+    void vma::stop_purging() noexcept
+    {
+        {
+            std::lock_guard<std::mutex> guard(purge_lock);
+            if(!purger.joinable())
+            {
+                return;
+            }
+            stop_purger = true;
+        }
+        purge_wake.notify_one();
+        purger.join();
+    }
+
+    bool vma::defers_purging() noexcept
+    {
+        return decay_ms.load(std::memory_order_relaxed) != 0;
+    }
+
+    bool vma::same_owner(void* lhs, void* rhs) noexcept
+    {
+        return is_safe_addr(lhs) && is_safe_addr(rhs) && owner_of(lhs) == owner_of(rhs);
+    }
+
+    void vma::purge_all() noexcept
+    {
+        std::unique_lock<std::mutex> guard(purge_lock);
+        while(!dirty.empty())
+        {
+            auto oldest = dirty.front();
+            dirty.pop_front();
+            dirty_bytes.store(dirty_bytes.load(std::memory_order_relaxed) - oldest.length, std::memory_order_relaxed);
+
+            guard.unlock();
+            purge_extent(oldest.addr, oldest.length);
+            guard.lock();
+        }
+    }
+
+    void vma::purge_loop() noexcept
+    {
+        using namespace std::chrono;
+        std::unique_lock<std::mutex> guard(purge_lock);
+        while(!stop_purger)
+        {
+            auto decay = milliseconds(decay_ms.load(std::memory_order_relaxed));
+            auto now   = steady_clock::now();
+
+            // each extent may keep the share of its pages that the decay curve has not reached yet
+            double allowed = 0;
+            for(auto& curr : dirty)
+            {
+                auto age = duration<double>(now - curr.freed) / decay;
+                allowed += curr.length * (1.0 - smoothstep(age));
+            }
+
+            // purge oldest first, until the dirty pages are back under the curve
+            while(!stop_purger && !dirty.empty() && dirty_bytes.load(std::memory_order_relaxed) > allowed)
+            {
+                auto oldest = dirty.front();
+                dirty.pop_front();
+                dirty_bytes.store(dirty_bytes.load(std::memory_order_relaxed) - oldest.length,
+                                  std::memory_order_relaxed);
+
+                guard.unlock();
+                purge_extent(oldest.addr, oldest.length);
+                guard.lock();
+            }
+
+            purge_wake.wait_for(guard, std::max(milliseconds(1), decay / static_cast<long>(utils::decay_steps)));
+        }
+    }
+
+    void vma::purge_extent(char* addr, size_t length) noexcept
+    {
+        auto end = addr + length;
+        for(auto piece = addr; piece < end;)
+        {
+            // granules change owners independently, so purge one granule at a time
+            auto piece_end = std::min(end, static_cast<char*>(region_start) + (granule_index(piece) + 1) * granule);
+            auto& owner    = shards[owner_of(piece)];
+
+            // only purge the parts that are still free. Each part is taken out of the list while it is purged, so
+            // it cannot be handed out, or change owners, in the meantime
+            for(auto curr = piece; curr < piece_end;)
+            {
+                size_t len = 0;
+                char* part;
+                {
+                    std::lock_guard<std::mutex> guard(owner.lock);
+                    part = static_cast<char*>(owner.list.take_free(curr, piece_end, len));
+                }
+                if(!part)
+                {
+                    break;
+                }
+
+#ifdef MADV_FREE
+                if(madvise(part, len, MADV_FREE) == -1)
+#endif
+                {
+                    madvise(part, len, MADV_DONTNEED);
+                }
+                purged_bytes.fetch_add(len, std::memory_order_relaxed);
+
+                {
+                    std::lock_guard<std::mutex> guard(owner.lock);
+                    owner.list.return_region(part, len);
+                }
+                curr = part + len;
+            }
+            piece = piece_end;
+        }
     }
 }        // namespace alloc
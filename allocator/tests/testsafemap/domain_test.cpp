@@ -0,0 +1,154 @@
+//
+// Tests for the registry of protection domains
+//
+
+#include "gtest/gtest.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <domain.hpp>
+#include <safemap.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <thread>
+
+namespace
+{
+    void* map_rw(alloc::vma* d, size_t size)
+    {
+        auto prot   = PROT_READ | PROT_WRITE;
+        auto flags  = alloc::utils::default_flags;
+        auto fd     = alloc::utils::default_fd;
+        auto offset = alloc::utils::default_offset;
+        return d->map_region(nullptr, size, prot, flags, fd, offset);
+    }
+
+    TEST(DomainTest, DomainsAreIsolated)
+    {
+        auto a = alloc::domain::create(1UL << 32U);
+        auto b = alloc::domain::create(1UL << 32U);
+        if(!a || !b)
+        {
+            GTEST_SKIP() << "protection keys are not supported";
+        }
+        EXPECT_NE(a->get_pkey(), b->get_pkey());
+
+        auto size = 4 * alloc::utils::min_alignment;
+        auto j    = static_cast<char*>(map_rw(a, size));
+        auto k    = static_cast<char*>(map_rw(b, size));
+        ASSERT_NE(j, MAP_FAILED);
+        ASSERT_NE(k, MAP_FAILED);
+
+        EXPECT_EQ(alloc::domain::of(j), a);
+        EXPECT_EQ(alloc::domain::of(j + size - 1), a);
+        EXPECT_EQ(alloc::domain::of(k), b);
+        EXPECT_EQ(alloc::domain::of(nullptr), nullptr);
+        EXPECT_EQ(alloc::domain::of(&size), nullptr);
+
+        EXPECT_EQ(a->unmap_region(j, size), 0);
+        EXPECT_EQ(b->unmap_region(k, size), 0);
+    }
+
+    TEST(DomainTest, SmallDomainsShareSlots)
+    {
+        // domains smaller than a lookup slot may share one, and must still be told apart
+        auto a = alloc::domain::create(1UL << 20U);
+        auto b = alloc::domain::create(1UL << 20U);
+        if(!a || !b)
+        {
+            GTEST_SKIP() << "protection keys are not supported";
+        }
+        EXPECT_EQ(alloc::domain::of(reinterpret_cast<void*>(a->safe_begin())), a);
+        EXPECT_EQ(alloc::domain::of(reinterpret_cast<void*>(a->safe_end() - 1)), a);
+        EXPECT_EQ(alloc::domain::of(reinterpret_cast<void*>(b->safe_begin())), b);
+        EXPECT_EQ(alloc::domain::of(reinterpret_cast<void*>(b->safe_end() - 1)), b);
+    }
+
+    TEST(DomainTest, ThreadsThatPredateADomainCanMapInIt)
+    {
+        std::atomic<pk_domain*> created(nullptr);
+        std::atomic<bool> ready(false);
+        int result = -1;
+
+        // the thread's rights are fixed before the domain's pkey exists
+        std::thread t([&] {
+            while(!ready.load())
+            {
+                std::this_thread::yield();
+            }
+            auto d = created.load();
+            auto size = 4 * alloc::utils::min_alignment;
+            auto page = static_cast<char*>(map_region_in(d, nullptr, size, PROT_READ | PROT_WRITE,
+                                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if(page == MAP_FAILED)
+            {
+                return;
+            }
+            enter_domain(d);
+            page[0] = 1;
+            exit_domain();
+            result = unmap_region_in(d, page, size);
+        });
+
+        created = pk_domain_create(1UL << 32U);
+        ready   = true;
+        t.join();
+        if(!created.load())
+        {
+            GTEST_SKIP() << "protection keys are not supported";
+        }
+        EXPECT_EQ(result, 0);
+    }
+
+    // caps the address space at what the process already uses plus headroom bytes
+    bool limit_address_space(size_t headroom)
+    {
+        auto statm   = fopen("/proc/self/statm", "r");
+        size_t pages = 0;
+        auto found   = statm && fscanf(statm, "%zu", &pages) == 1;
+        if(statm)
+        {
+            fclose(statm);
+        }
+        rlimit limit = {pages * 4096 + headroom, pages * 4096 + headroom};
+        return found && setrlimit(RLIMIT_AS, &limit) == 0;
+    }
+
+    // creates a domain that cannot be reserved under a tight address space limit, and reports what went wrong
+    int create_beyond_limit()
+    {
+        auto key = pkey_alloc(0, 0);
+        if(key == -1)
+        {
+            return 0;        // nothing to test without protection keys
+        }
+        pkey_free(key);
+
+        if(!limit_address_space(1UL << 32U))
+        {
+            return 1;
+        }
+        errno = 0;
+        if(pk_domain_create(1UL << 40U) != nullptr || errno != ENOMEM)
+        {
+            return 2;
+        }
+
+        // the pkey went back to the kernel
+        key = pkey_alloc(0, 0);
+        return key == -1 ? 3 : 0;
+    }
+
+    TEST(DomainTest, ReportsDomainsThatCannotBeReserved)
+    {
+        GTEST_FLAG_SET(death_test_style, "threadsafe");
+        EXPECT_EXIT(exit(create_beyond_limit()), ::testing::ExitedWithCode(0), "^$");
+    }
+
+    TEST(DomainTest, RejectsOversizedDomains)
+    {
+        errno = 0;
+        EXPECT_EQ(alloc::domain::create(alloc::utils::default_size + 1), nullptr);
+        EXPECT_EQ(errno, EINVAL);
+    }
+}        // namespace
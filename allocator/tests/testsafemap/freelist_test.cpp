@@ -84,9 +84,36 @@ namespace
 
     TEST_F(FreelistTest, SearchAssertsCorruptedList) {}
 
-    TEST_F(FreelistTest, SearchFindsValidAddr) {}
+    TEST_F(FreelistTest, SearchFindsValidAddr)
+    {
+        char* start = static_cast<char*>(buff);
+        char* end   = start + init_size;
+
+        l.init(start, end);
+        auto page = alloc::utils::default_alignment;
+        for(auto ptr = start + page; ptr < end; ptr += page)
+        {
+            auto j = l.search(ptr);
+            ASSERT_NE(j, nullptr);
+            EXPECT_EQ(j->start, start + page);
+            EXPECT_EQ(j->end, end);
+        }
+    }
+
+    TEST_F(FreelistTest, SearchReturnsNullBadAddr)
+    {
+        char* start = static_cast<char*>(buff);
+        char* end   = start + init_size;
+
+        l.init(start, end);
+        EXPECT_EQ(l.search(start - 1), nullptr);
+        EXPECT_EQ(l.search(end + 1), nullptr);
 
-    TEST_F(FreelistTest, SearchReturnsNullBadAddr) {}
+        // allocated memory is no longer in the freelist
+        auto page = alloc::utils::default_alignment;
+        ASSERT_EQ(l.request(start + page, page, page), start + page);
+        EXPECT_EQ(l.search(start + page), nullptr);
+    }
 
     TEST_F(FreelistTest, SpliteturnsNullBadAddr) {}
 
@@ -94,12 +121,199 @@ namespace
 
     TEST_F(FreelistTest, SplitReturnsNull) {}
 
-    TEST_F(FreelistTest, Request) {}
+    TEST_F(FreelistTest, Request)
+    {
+        char* start = static_cast<char*>(buff);
+        char* end   = start + init_size;
+        auto page   = alloc::utils::default_alignment;
+
+        l.init(start, end);
+
+        // split the free pages into a two page block and a one page block
+        ASSERT_EQ(l.request(start + 3 * page, page, page), start + 3 * page);
+
+        // a single page fits best in the smaller block, not at the front of the larger one
+        EXPECT_EQ(l.request(page), start + 4 * page);
+        EXPECT_EQ(l.request(2 * page), start + page);
+        EXPECT_EQ(l.request(page), nullptr);
+    }
+
+    TEST_F(FreelistTest, RequestFromSizeBins)
+    {
+        auto page   = alloc::utils::default_alignment;
+        auto len    = 202 * page;
+        auto region = mmap(nullptr, len, PROT_READ | PROT_WRITE, alloc::utils::default_flags, -1, 0);
+        ASSERT_NE(region, MAP_FAILED);
+        char* start = static_cast<char*>(region);
+
+        // pages [1, 101) and [102, 202) are free: both blocks live in the same power of two bin
+        alloc::freelist list(start, start + len);
+        ASSERT_EQ(list.request(start + 101 * page, page, page), start + 101 * page);
+
+        // split remainders move to the bin for their new size
+        auto j = static_cast<char*>(list.request(80 * page));
+        ASSERT_NE(j, nullptr);
+        EXPECT_NE(list.request(80 * page), nullptr);
+        EXPECT_EQ(list.request(80 * page), nullptr);
+        EXPECT_NE(list.request(20 * page), nullptr);
+        EXPECT_NE(list.request(20 * page), nullptr);
+        EXPECT_EQ(list.request(page), nullptr);
+
+        list.return_region(j, 80 * page);
+        EXPECT_EQ(list.request(j, 80 * page, page), j);
+        munmap(region, len);
+    }
+
+    TEST_F(FreelistTest, LargestExtentFollowsPowerOfTwoBins)
+    {
+        auto page   = alloc::utils::default_alignment;
+        auto len    = 302 * page;
+        auto region = mmap(nullptr, len, PROT_READ | PROT_WRITE, alloc::utils::default_flags, -1, 0);
+        ASSERT_NE(region, MAP_FAILED);
+        char* start = static_cast<char*>(region);
+
+        // 100, 80 and 119 free pages, all in the same power of two bin
+        alloc::freelist list(start, start + len);
+        ASSERT_EQ(list.request(start + 101 * page, page, page), start + 101 * page);
+        ASSERT_EQ(list.request(start + 182 * page, page, page), start + 182 * page);
+        EXPECT_EQ(list.largest_extent(), 119 * page);
+
+        // the largest extent leaving the bin hands over to the next largest
+        ASSERT_EQ(list.request(start + 183 * page, 119 * page, page), start + 183 * page);
+        EXPECT_EQ(list.largest_extent(), 100 * page);
+        ASSERT_EQ(list.request(start + page, 100 * page, page), start + page);
+        EXPECT_EQ(list.largest_extent(), 80 * page);
+
+        list.return_region(start + 183 * page, 119 * page);
+        EXPECT_EQ(list.largest_extent(), 119 * page);
+        ASSERT_EQ(list.request(start + 183 * page, 10 * page, page), start + 183 * page);
+        EXPECT_EQ(list.largest_extent(), 109 * page);
+        munmap(region, len);
+    }
+
+    TEST_F(FreelistTest, ReturnRegion)
+    {
+        char* start = static_cast<char*>(buff);
+        char* end   = start + init_size;
+        auto page   = alloc::utils::default_alignment;
+
+        l.init(start, end);
+        for(auto ptr = start + page; ptr < end; ptr += page)
+        {
+            ASSERT_EQ(l.request(ptr, page, page), ptr);
+        }
+        EXPECT_EQ(l.mem_available(), 0);
+
+        // returned pages merge with whichever neighbors are already free
+        l.return_region(start + page, page);
+        l.return_region(start + 3 * page, page);
+        EXPECT_EQ(l.search(start + page)->end, start + 2 * page);
+        l.return_region(start + 4 * page, page);
+        EXPECT_EQ(l.search(start + 3 * page)->end, end);
+        l.return_region(start + 2 * page, page);
+
+        auto j = l.search(start + page);
+        ASSERT_NE(j, nullptr);
+        EXPECT_EQ(j->start, start + page);
+        EXPECT_EQ(j->end, end);
+        EXPECT_EQ(l.mem_available(), end - (start + page));
+    }
 
-    TEST_F(FreelistTest, ReturnRegion) {}
+    TEST_F(FreelistTest, NodesAreRecycled)
+    {
+        char* start = static_cast<char*>(buff);
+        char* end   = start + init_size;
+        auto page   = alloc::utils::default_alignment;
+
+        // the metadata page only holds a few dozen nodes, so splitting and merging must reuse them
+        l.init(start, end);
+        for(int i = 0; i < 10000; i++)
+        {
+            ASSERT_EQ(l.request(start + 2 * page, page, page), start + 2 * page);
+            l.return_region(start + 2 * page, page);
+        }
+        EXPECT_EQ(l.mem_available(), end - (start + page));
+    }
 
     TEST_F(FreelistTest, ReleaseFreelist) {}
 
     TEST_F(FreelistTest, IsMapped) {}
 
+    /**
+     * Leaves holes of 4, 3 and 3 pages, in that order, separated by allocated pages and followed by 6 free pages
+     */
+    template <typename Placement>
+    struct holes
+    {
+        static constexpr size_t pages = 20;
+        const size_t page             = alloc::utils::default_alignment;
+        alloc::basic_freelist<Placement> list;
+        char* region;
+        char* base;
+
+        holes()
+        {
+            region = static_cast<char*>(mmap(nullptr, pages * page, PROT_READ | PROT_WRITE, alloc::utils::default_flags,
+                                             -1, 0));
+            list.init(region, region + pages * page);
+            base = region + page;        // the first page holds the list's nodes
+
+            for(size_t n : {4, 1, 3, 1, 3, 1})
+            {
+                list.request(n * page);
+            }
+            list.return_region(at(0), 4 * page);
+            list.return_region(at(9), 3 * page);
+            list.return_region(at(5), 3 * page);
+        }
+
+        ~holes()
+        {
+            munmap(region, pages * page);
+        }
+
+        char* at(size_t n) const
+        {
+            return base + n * page;
+        }
+    };
+
+    TEST(PlacementTest, SegregatedFitUsesTheExactBin)
+    {
+        holes<alloc::segregated_fit> h;
+        auto p = static_cast<char*>(h.list.request(3 * h.page));
+        EXPECT_TRUE(p == h.at(5) || p == h.at(9));
+    }
+
+    TEST(PlacementTest, FirstFitTakesTheLowestHole)
+    {
+        holes<alloc::first_fit> h;
+        EXPECT_EQ(h.list.request(3 * h.page), h.at(0));
+        EXPECT_EQ(h.list.request(3 * h.page), h.at(5));
+    }
+
+    TEST(PlacementTest, NextFitResumesAndWraps)
+    {
+        holes<alloc::next_fit> h;
+        EXPECT_EQ(h.list.request(3 * h.page), h.at(13));
+        EXPECT_EQ(h.list.request(4 * h.page), h.at(0));
+        EXPECT_EQ(h.list.request(3 * h.page), h.at(5));
+    }
+
+    TEST(PlacementTest, BestFitTakesTheSmallestHole)
+    {
+        holes<alloc::best_fit> h;
+        auto p = static_cast<char*>(h.list.request(3 * h.page));
+        EXPECT_TRUE(p == h.at(5) || p == h.at(9));
+        EXPECT_EQ(h.list.request(4 * h.page), h.at(0));
+    }
+
+    TEST(PlacementTest, AddressBestFitBreaksTiesByAddress)
+    {
+        holes<alloc::address_best_fit> h;
+        EXPECT_EQ(h.list.request(3 * h.page), h.at(5));
+        EXPECT_EQ(h.list.request(3 * h.page), h.at(9));
+        EXPECT_EQ(h.list.request(5 * h.page), h.at(13));
+    }
+
 }        // namespace
@@ -0,0 +1,146 @@
+//
+// Tests for the call gates
+//
+
+#include "gtest/gtest.h"
+#include <gate.hpp>
+#include <sys/mman.h>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    class GateTest : public ::testing::Test
+    {
+    protected:
+        int key = -1;
+
+        virtual void SetUp()
+        {
+            key = pkey_alloc(0, PKEY_DISABLE_ACCESS);
+            if(key < 0)
+            {
+                GTEST_SKIP() << "protection keys are not supported";
+            }
+            alloc::pkru::shadow::refresh();
+        }
+
+        virtual void TearDown()
+        {
+            if(key >= 0)
+            {
+                alloc::pkru::shadow::set(key, 0);
+                pkey_free(key);
+            }
+        }
+    };
+
+    TEST_F(GateTest, NestedGatesRestoreExactly)
+    {
+        auto outside = alloc::pkru::read();
+        EXPECT_EQ(alloc::pkru::get(key), alloc::pkru::access_disable);
+        {
+            alloc::trusted_scope trusted(key);
+            EXPECT_EQ(alloc::pkru::get(key), 0U);
+            {
+                alloc::trusted_scope nested(key);
+                EXPECT_EQ(alloc::gate::depth(), 2U);
+                EXPECT_EQ(alloc::pkru::get(key), 0U);
+
+                // bounce out to untrusted code and back in
+                alloc::untrusted_scope callback(key);
+                EXPECT_EQ(alloc::pkru::get(key), alloc::pkru::access_disable);
+                {
+                    alloc::trusted_scope reentry(key);
+                    EXPECT_EQ(alloc::pkru::get(key), 0U);
+                }
+                EXPECT_EQ(alloc::pkru::get(key), alloc::pkru::access_disable);
+            }
+            EXPECT_EQ(alloc::gate::depth(), 1U);
+            EXPECT_EQ(alloc::pkru::get(key), 0U);
+        }
+        EXPECT_EQ(alloc::gate::depth(), 0U);
+        EXPECT_EQ(alloc::pkru::read(), outside);
+    }
+
+    TEST_F(GateTest, CountersSumAcrossThreads)
+    {
+        auto before = alloc::gate::crossings();
+        std::vector<std::thread> threads;
+        for(int i = 0; i < 4; ++i)
+        {
+            threads.emplace_back([this] {
+                for(int j = 0; j < 1000; ++j)
+                {
+                    alloc::trusted_scope trusted(key);
+                }
+            });
+        }
+        for(auto& t : threads)
+        {
+            t.join();
+        }
+
+        // counts of exited threads are kept
+        EXPECT_EQ(alloc::gate::crossings() - before, 4000U);
+    }
+
+    TEST_F(GateTest, SitesRecordHistograms)
+    {
+        static alloc::gate::site site = {"histogram_test", {}, nullptr, 0};
+        alloc::gate::profiling.store(true);
+        for(int i = 0; i < 100; ++i)
+        {
+            alloc::trusted_scope trusted(key, site);
+        }
+        alloc::gate::profiling.store(false);
+
+        uint64_t switches = 0;
+        for(auto count : site.buckets)
+        {
+            switches += count;
+        }
+        EXPECT_EQ(switches, 200U);
+
+        bool found = false;
+        for(auto s = alloc::gate::first_site(); s != nullptr; s = s->next)
+        {
+            found = found || s == &site;
+        }
+        EXPECT_TRUE(found);
+    }
+
+    TEST(KeylessGateTest, GatesWithoutAKeyLeavePkruAlone)
+    {
+        // only read the register where it exists
+        auto probe  = pkey_alloc(0, 0);
+        auto before = probe >= 0 ? alloc::pkru::read() : 0U;
+        {
+            alloc::trusted_scope trusted(-1);
+            alloc::untrusted_scope nested(-1);
+            EXPECT_EQ(alloc::gate::depth(), 2U);
+            if(probe >= 0)
+            {
+                EXPECT_EQ(alloc::pkru::read(), before);
+            }
+        }
+        EXPECT_EQ(alloc::gate::depth(), 0U);
+
+        if(probe >= 0)
+        {
+            // a keyed gate nested in a keyless one still restores its own frame
+            {
+                alloc::trusted_scope outer(-1);
+                alloc::untrusted_scope inner(probe);
+                EXPECT_EQ(alloc::pkru::get(probe), alloc::pkru::access_disable);
+            }
+            EXPECT_EQ(alloc::pkru::read(), before);
+            pkey_free(probe);
+        }
+    }
+
+    TEST_F(GateTest, UnmatchedExitAborts)
+    {
+        EXPECT_DEATH(alloc::gate::exit(), "without a matching enter");
+    }
+}        // namespace
@@ -0,0 +1,82 @@
+//
+// Tests for the inline PKRU accessors and the thread-local shadow
+//
+
+#include "gtest/gtest.h"
+#include <gate.hpp>
+#include <mpk.h>
+#include <pkru.hpp>
+#include <sys/mman.h>
+
+namespace
+{
+    class PkruTest : public ::testing::Test
+    {
+    protected:
+        int key = -1;
+
+        virtual void SetUp()
+        {
+            key = pkey_alloc(0, 0);
+            if(key < 0)
+            {
+                GTEST_SKIP() << "protection keys are not supported";
+            }
+            alloc::pkru::shadow::refresh();
+        }
+
+        virtual void TearDown()
+        {
+            if(key >= 0)
+            {
+                alloc::pkru::shadow::set(key, 0);
+                pkey_free(key);
+            }
+        }
+    };
+
+    TEST_F(PkruTest, MasksArePerKey)
+    {
+        static_assert(alloc::pkru::key_mask(0) == 0x3U, "key 0 uses the low bits");
+        static_assert(alloc::pkru::key_rights(2, alloc::pkru::write_disable) == 0x20U, "rights are shifted by key");
+        EXPECT_EQ(alloc::pkru::with_rights(0, 3, alloc::pkru::access_disable), 0x40U);
+    }
+
+    TEST_F(PkruTest, SetAndGetRoundTrip)
+    {
+        alloc::pkru::set(key, alloc::pkru::write_disable);
+        EXPECT_EQ(alloc::pkru::get(key), alloc::pkru::write_disable);
+        alloc::pkru::set(key, 0);
+        EXPECT_EQ(alloc::pkru::get(key), 0U);
+    }
+
+    TEST_F(PkruTest, ShadowTracksRegister)
+    {
+        alloc::pkru::shadow::set(key, alloc::pkru::access_disable);
+        EXPECT_EQ(alloc::pkru::shadow::get(key), alloc::pkru::access_disable);
+        EXPECT_EQ(alloc::pkru::read(), alloc::pkru::shadow::read());
+
+        // a write behind the shadow's back is only seen after a refresh
+        alloc::pkru::set(key, alloc::pkru::write_disable);
+        EXPECT_EQ(alloc::pkru::shadow::get(key), alloc::pkru::access_disable);
+        alloc::pkru::shadow::refresh();
+        EXPECT_EQ(alloc::pkru::shadow::get(key), alloc::pkru::write_disable);
+    }
+
+    TEST_F(PkruTest, CApiKeepsTheShadowForGates)
+    {
+        // the legacy C API lifts the restriction the shadow last saw, so the gate has a real change to make
+        alloc::pkru::shadow::set(key, alloc::pkru::access_disable);
+        ASSERT_EQ(pkru_pkey_set(key, 0), 0);
+        alloc::gate::enter_untrusted(key);
+        EXPECT_EQ(alloc::pkru::get(key), alloc::pkru::access_disable);
+        alloc::gate::exit();
+        EXPECT_EQ(alloc::pkru::get(key), 0U);
+
+        pkru_pkey_write(alloc::pkru::with_rights(alloc::pkru::read(), key, alloc::pkru::access_disable));
+        alloc::gate::enter_trusted(key);
+        EXPECT_EQ(alloc::pkru::get(key), 0U);
+        alloc::gate::exit();
+        EXPECT_EQ(alloc::pkru::get(key), alloc::pkru::access_disable);
+    }
+}        // namespace
@@ -0,0 +1,125 @@
+//
+// Tests for the C API around the default domain
+//
+
+#include "gtest/gtest.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <pkru.hpp>
+#include <safemap.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <thread>
+
+namespace
+{
+    // reserves the default domain lazily with the given rights, in a fresh process, and reports what went wrong
+    int lazy_start(const char* rights, unsigned int expected)
+    {
+        setenv("PKALLOC_SIZE", "1G", 1);
+        setenv("PKALLOC_RIGHTS", rights, 1);
+        auto page = static_cast<char*>(map_region(nullptr, 4096, PROT_READ | PROT_WRITE,
+                                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if(page == MAP_FAILED || !pk_initialized())
+        {
+            return 1;
+        }
+
+        auto key = vma_pkey();
+        if(key != -1 && alloc::pkru::get(key) != expected)
+        {
+            return 2;
+        }
+
+        // from then on the domain is only reachable through a gate
+        enter_trusted();
+        page[0]     = 1;
+        auto result = unmap_region(page, 4096);
+        exit_trusted();
+        return result == 0 ? 0 : 3;
+    }
+
+    // checks a stack address from another thread while the default domain is reserved, and reports whether it was
+    // ever taken for part of the domain
+    int racing_bounds()
+    {
+        setenv("PKALLOC_SIZE", "1G", 1);
+        int local = 0;
+        std::atomic<bool> done(false);
+        std::atomic<bool> wrong(false);
+        std::thread reader([&] {
+            while(!done.load(std::memory_order_relaxed))
+            {
+                if(pk_is_safe_address(&local) || is_safe_range(&local, sizeof(local)))
+                {
+                    wrong = true;
+                }
+            }
+        });
+
+        auto page = map_region(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        done = true;
+        reader.join();
+        if(page == MAP_FAILED || !pk_is_safe_address(page))
+        {
+            return 1;
+        }
+        return wrong.load() ? 2 : 0;
+    }
+
+    TEST(SafemapTest, BoundsNeverCoverOtherMemoryWhileTheDomainIsReserved)
+    {
+        GTEST_FLAG_SET(death_test_style, "threadsafe");
+        EXPECT_EXIT(exit(racing_bounds()), ::testing::ExitedWithCode(0), "");
+    }
+
+    // caps the address space at what the process already uses plus headroom bytes
+    bool limit_address_space(size_t headroom)
+    {
+        auto statm   = fopen("/proc/self/statm", "r");
+        size_t pages = 0;
+        auto found   = statm && fscanf(statm, "%zu", &pages) == 1;
+        if(statm)
+        {
+            fclose(statm);
+        }
+        rlimit limit = {pages * 4096 + headroom, pages * 4096 + headroom};
+        return found && setrlimit(RLIMIT_AS, &limit) == 0;
+    }
+
+    // asks pk_init() for more address space than the process may have, then for a size that fits
+    int init_beyond_limit()
+    {
+        if(!limit_address_space(1UL << 32U))
+        {
+            return 1;
+        }
+
+        pk_config config = {};
+        config.size      = 1UL << 40U;
+        errno            = 0;
+        if(pk_init(&config) != -1 || errno != ENOMEM || pk_initialized())
+        {
+            return 2;
+        }
+
+        config.size = 1UL << 26U;
+        return pk_init(&config) == 0 && pk_initialized() ? 0 : 3;
+    }
+
+    TEST(SafemapTest, InitReportsARegionThatCannotBeReserved)
+    {
+        GTEST_FLAG_SET(death_test_style, "threadsafe");
+        EXPECT_EXIT(exit(init_beyond_limit()), ::testing::ExitedWithCode(0), "");
+    }
+
+    TEST(SafemapTest, LazyInitAppliesRightsOnceTheFirstCallReturns)
+    {
+        // each case needs a process that has not reserved the default domain yet
+        GTEST_FLAG_SET(death_test_style, "threadsafe");
+        EXPECT_EXIT(exit(lazy_start("none", alloc::pkru::access_disable)), ::testing::ExitedWithCode(0), "");
+        EXPECT_EXIT(exit(lazy_start("ro", alloc::pkru::write_disable)), ::testing::ExitedWithCode(0), "");
+    }
+}        // namespace
@@ -0,0 +1,90 @@
+//
+// Tests for the map/unmap trace
+//
+
+#include "gtest/gtest.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <trace.hpp>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    std::vector<alloc::trace::record> read_trace(const char* path, alloc::trace::header& h)
+    {
+        std::vector<alloc::trace::record> records;
+        auto file = fopen(path, "rb");
+        if(!file)
+        {
+            return records;
+        }
+        if(fread(&h, sizeof(h), 1, file) == 1)
+        {
+            alloc::trace::record r;
+            while(fread(&r, sizeof(r), 1, file) == 1)
+            {
+                records.push_back(r);
+            }
+        }
+        fclose(file);
+        return records;
+    }
+
+    TEST(TraceTest, RecordsEventsFromEveryThread)
+    {
+        char path[] = "/tmp/pktraceXXXXXX";
+        auto fd     = mkstemp(path);
+        ASSERT_NE(fd, -1);
+        close(fd);
+
+        // nothing is recorded while tracing is off
+        alloc::trace::event(alloc::trace::op_map, path, 1, 3);
+
+        ASSERT_TRUE(alloc::trace::start(path));
+        EXPECT_FALSE(alloc::trace::start(path));
+
+        auto started = alloc::trace::now();
+        alloc::trace::event(alloc::trace::op_map, reinterpret_cast<void*>(0x1000), 4096, 3);
+        alloc::trace::event(alloc::trace::op_unmap, reinterpret_cast<void*>(0x1000), 4096, 0, started);
+
+        // more than a buffer's worth from another thread, which flushes as it fills and when it exits
+        std::thread other([] {
+            for(size_t i = 0; i < alloc::trace::buffer_records + 10; ++i)
+            {
+                alloc::trace::event(alloc::trace::op_map, reinterpret_cast<void*>(0x2000), 8192, 1);
+            }
+        });
+        other.join();
+        alloc::trace::stop();
+        alloc::trace::event(alloc::trace::op_map, path, 1, 3);
+
+        alloc::trace::header h = {};
+        auto records           = read_trace(path, h);
+        unlink(path);
+
+        EXPECT_EQ(memcmp(h.magic, alloc::trace::magic, sizeof(h.magic)), 0);
+        EXPECT_EQ(h.version, alloc::trace::version);
+        EXPECT_EQ(h.record_size, sizeof(alloc::trace::record));
+        ASSERT_EQ(records.size(), alloc::trace::buffer_records + 12);
+
+        size_t ours = 0;
+        for(auto& r : records)
+        {
+            if(r.addr == 0x1000)
+            {
+                ++ours;
+                EXPECT_EQ(r.length, 4096U);
+                EXPECT_EQ(r.prot, r.op == alloc::trace::op_map ? 3 : 0);
+            }
+            else
+            {
+                EXPECT_EQ(r.op, alloc::trace::op_map);
+                EXPECT_EQ(r.length, 8192U);
+            }
+        }
+        EXPECT_EQ(ours, 2U);
+    }
+}        // namespace
@@ -3,7 +3,16 @@
 //
 
 #include "gtest/gtest.h"
+#include <classify.hpp>
+#include <extent_hooks.hpp>
+#include <pkru.hpp>
+#include <ready_pool.hpp>
+#include <thread_cache.hpp>
 #include <vma.hpp>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace
 {
@@ -118,4 +127,554 @@ namespace
         EXPECT_EQ(j, MAP_FAILED);
     }
 
+    TEST_F(VmaTest, MethodUnmapRegionRejectsForeignAddress)
+    {
+        int local = 0;
+        EXPECT_EQ(v.unmap_region(&local, alloc::utils::min_alignment), -1);
+        EXPECT_EQ(errno, EINVAL);
+    }
+
+    TEST_F(VmaTest, MethodMapRegionLargeAndSmallInterleaved)
+    {
+        // requests of a granule or more come from the pool, smaller ones from the shards
+        auto large = alloc::utils::shard_granule * 2;
+        auto small = alloc::utils::min_alignment * 3;
+        auto j     = alloc_pages(large);
+        auto k     = alloc_pages(small);
+        ASSERT_NE(j, MAP_FAILED);
+        ASSERT_NE(k, MAP_FAILED);
+        EXPECT_TRUE(v.is_safe_addr(j));
+        EXPECT_TRUE(v.is_safe_addr(k));
+        EXPECT_EQ(v.unmap_region(k, small), 0);
+        EXPECT_EQ(v.unmap_region(j, large), 0);
+    }
+
+    TEST_F(VmaTest, MethodGetStatsTracksMappings)
+    {
+        alloc::vma_stats before;
+        alloc::vma_stats after;
+        auto size = 5 * alloc::utils::min_alignment;
+
+        v.get_stats(before);
+        EXPECT_EQ(before.reserved, alloc::utils::default_size);
+        EXPECT_LE(before.largest_free, before.free);
+
+        auto j = alloc_pages(size);
+        ASSERT_NE(j, MAP_FAILED);
+        v.get_stats(after);
+        EXPECT_EQ(after.free, before.free - size);
+
+        EXPECT_EQ(v.unmap_region(j, size), 0);
+        v.get_stats(after);
+        EXPECT_EQ(after.free, before.free);
+    }
+
+    TEST_F(VmaTest, MethodMapRegionsReportsPerElement)
+    {
+        alloc::vma_stats before;
+        alloc::vma_stats after;
+        auto page = alloc::utils::min_alignment;
+        alloc::region_request regions[4] = {{nullptr, 2 * page, -1}, {nullptr, 0, -1}, {nullptr, page, -1},
+                                            {nullptr, 3 * page, -1}};
+
+        v.get_stats(before);
+        EXPECT_EQ(v.map_regions(regions, 4, PROT_READ | PROT_WRITE), 3U);
+        EXPECT_EQ(regions[1].addr, MAP_FAILED);
+        EXPECT_EQ(regions[1].err, EINVAL);
+        for(auto i : {0, 2, 3})
+        {
+            ASSERT_EQ(regions[i].err, 0);
+            ASSERT_TRUE(v.is_safe_addr(regions[i].addr));
+            static_cast<char*>(regions[i].addr)[0] = 'x';
+        }
+
+        // an overlapping duplicate must not return its pages twice
+        alloc::region_request unmaps[5] = {regions[3], regions[0], regions[2], regions[0], {&regions, page, -1}};
+        EXPECT_EQ(v.unmap_regions(unmaps, 5), 3U);
+        EXPECT_EQ(unmaps[0].err, 0);
+        EXPECT_EQ(unmaps[1].err + unmaps[3].err, EINVAL);
+        EXPECT_EQ(unmaps[4].err, EINVAL);
+        v.get_stats(after);
+        EXPECT_EQ(after.free, before.free);
+    }
+
+    TEST_F(VmaTest, MethodSetPurgeDecayDefersPurging)
+    {
+        alloc::vma_stats before;
+        alloc::vma_stats after;
+        auto size = 6 * alloc::utils::min_alignment;
+
+        // a long decay, so the background purger leaves the pages alone
+        v.set_purge_decay(std::chrono::hours(1));
+        v.get_stats(before);
+        auto j = static_cast<char*>(alloc_pages(size));
+        ASSERT_NE(j, MAP_FAILED);
+        j[0] = 'x';
+        EXPECT_EQ(v.unmap_region(j, size), 0);
+
+        v.get_stats(after);
+        EXPECT_EQ(after.dirty, before.dirty + size);
+        EXPECT_EQ(after.free, before.free);
+
+        v.purge_all();
+        v.get_stats(after);
+        EXPECT_EQ(after.dirty, 0U);
+        EXPECT_GE(after.purged, before.purged + size);
+        EXPECT_EQ(after.free, before.free);
+        v.set_purge_decay(std::chrono::milliseconds(0));
+    }
+
+    TEST_F(VmaTest, MethodAlignedMapRegionHonorsAlignment)
+    {
+        auto huge = size_t(2) << 20U;
+        auto j    = v.aligned_map_region(huge, huge, PROT_READ | PROT_WRITE, alloc::vma::map_hugepage);
+        ASSERT_NE(j, MAP_FAILED);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(j) % huge, 0U);
+        static_cast<char*>(j)[huge - 1] = 'x';
+
+        auto gig = alloc::utils::shard_granule;
+        auto k   = v.aligned_map_region(alloc::utils::min_alignment, gig, PROT_READ, 0);
+        ASSERT_NE(k, MAP_FAILED);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(k) % gig, 0U);
+
+        EXPECT_EQ(v.aligned_map_region(huge, 3 * alloc::utils::min_alignment, PROT_READ, 0), MAP_FAILED);
+        EXPECT_EQ(errno, EINVAL);
+        EXPECT_EQ(v.unmap_region(j, huge), 0);
+        EXPECT_EQ(v.unmap_region(k, alloc::utils::min_alignment), 0);
+    }
+
+    TEST_F(VmaTest, MethodRemapRegionGrowsShrinksAndMoves)
+    {
+        auto page = alloc::utils::min_alignment;
+        auto j    = static_cast<char*>(alloc_pages(page));
+        ASSERT_NE(j, MAP_FAILED);
+        j[0] = 'x';
+
+        // the pages after a fresh region are free, so it grows and shrinks in place
+        ASSERT_EQ(v.remap_region(j, page, 4 * page, 0), j);
+        EXPECT_EQ(j[0], 'x');
+        j[4 * page - 1] = 'y';
+        ASSERT_EQ(v.remap_region(j, 4 * page, page, 0), j);
+
+        // block the tail, so growing requires a move
+        auto k = v.map_region(j + page, page, PROT_READ, alloc::utils::default_flags, -1, 0);
+        ASSERT_EQ(k, j + page);
+        EXPECT_EQ(v.remap_region(j, page, 3 * page, 0), MAP_FAILED);
+        EXPECT_EQ(errno, ENOMEM);
+
+        auto m = static_cast<char*>(v.remap_region(j, page, 3 * page, alloc::vma::remap_maymove));
+        ASSERT_NE(m, MAP_FAILED);
+        EXPECT_NE(m, j);
+        EXPECT_EQ(m[0], 'x');
+        EXPECT_EQ(m[3 * page - 1], 0);
+        m[3 * page - 1] = 'z';
+
+        // the old range was never left unmapped, so nothing else can be mapped there
+        auto probe = mmap(j, page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        EXPECT_EQ(probe, MAP_FAILED);
+        EXPECT_EQ(errno, EEXIST);
+
+        EXPECT_EQ(v.unmap_region(m, 3 * page), 0);
+        EXPECT_EQ(v.unmap_region(k, page), 0);
+    }
+
+    TEST_F(VmaTest, ExtentHooksSplitAndMergeInPlace)
+    {
+        alloc::vma_extent_hooks adapter(&v);
+        auto hooks  = &adapter.hooks;
+        auto size   = size_t(2) << 20U;
+        auto page   = alloc::utils::min_alignment;
+        bool zero   = false;
+        bool commit = false;
+
+        auto a = static_cast<char*>(hooks->alloc(hooks, nullptr, size, size, &zero, &commit, 0));
+        ASSERT_NE(a, nullptr);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(a) % size, 0U);
+        EXPECT_TRUE(commit);
+        a[size - 1] = 'x';
+
+        // grow the extent with a fixed request for the pages after it, then merge the two
+        auto b = static_cast<char*>(hooks->alloc(hooks, a + size, size, page, &zero, &commit, 0));
+        ASSERT_EQ(b, a + size);
+        EXPECT_FALSE(hooks->merge(hooks, a, size, b, size, true, 0));
+
+        EXPECT_FALSE(hooks->decommit(hooks, a, 2 * size, size, size, 0));
+        EXPECT_FALSE(hooks->commit(hooks, a, 2 * size, size, size, 0));
+        EXPECT_EQ(b[0], 0);
+        EXPECT_FALSE(hooks->purge_forced(hooks, a, 2 * size, 0, size, 0));
+        EXPECT_EQ(a[size - 1], 0);
+
+        // split it unevenly, and give the pieces back separately
+        EXPECT_FALSE(hooks->split(hooks, a, 2 * size, page, 2 * size - page, true, 0));
+        EXPECT_FALSE(hooks->dalloc(hooks, a + page, 2 * size - page, true, 0));
+        EXPECT_FALSE(hooks->dalloc(hooks, a, page, true, 0));
+    }
+
+    TEST_F(VmaTest, ReadyPoolServesConfiguredSizes)
+    {
+        alloc::ready_pool pool(&v);
+        alloc::ready_stats stats;
+        size_t sizes[] = {alloc::utils::min_alignment, 3 * alloc::utils::min_alignment};
+        auto rw        = PROT_READ | PROT_WRITE;
+
+        EXPECT_FALSE(pool.configure(sizes, 2, 4, 5, false));
+        ASSERT_TRUE(pool.configure(sizes, 2, 4, 1, true));
+        pool.get_stats(stats);
+        EXPECT_EQ(stats.held, 4 * (sizes[0] + sizes[1]));
+
+        // only the pooled sizes, with the pooled protections, are served
+        EXPECT_EQ(pool.map(2 * alloc::utils::min_alignment, rw), nullptr);
+        EXPECT_EQ(pool.map(sizes[1], PROT_READ), nullptr);
+
+        void* regions[5];
+        for(auto& r : regions)
+        {
+            r = pool.map(sizes[1], rw);
+        }
+        for(size_t i = 0; i < 4; ++i)
+        {
+            ASSERT_NE(regions[i], nullptr);
+            static_cast<char*>(regions[i])[0] = 'x';
+        }
+
+        // the last request races with the refill woken by the fourth
+        pool.get_stats(stats);
+        EXPECT_EQ(stats.hits + stats.misses, 5U);
+        EXPECT_EQ(regions[4] == nullptr, stats.misses == 1U);
+        for(auto r : regions)
+        {
+            if(r)
+            {
+                EXPECT_EQ(v.unmap_region(r, sizes[1]), 0);
+            }
+        }
+    }
+
+    TEST_F(VmaTest, ReadyPoolRetriesAFailedRefill)
+    {
+        auto page = alloc::utils::min_alignment;
+        alloc::vma w(1, 8 * page);
+        alloc::ready_pool pool(&w);
+        alloc::ready_stats stats;
+        size_t sizes[] = {2 * page};
+        auto rw        = PROT_READ | PROT_WRITE;
+
+        // the pool takes the whole reservation, so the refill woken as the class crosses its low-water mark finds no
+        // pages once every region is handed out
+        ASSERT_TRUE(pool.configure(sizes, 1, 4, 4, false));
+        void* regions[4];
+        for(auto& r : regions)
+        {
+            r = pool.map(sizes[0], rw);
+            ASSERT_NE(r, nullptr);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        EXPECT_EQ(w.unmap_region(regions[0], sizes[0]), 0);
+        EXPECT_EQ(w.unmap_region(regions[1], sizes[0]), 0);
+
+        // the next request misses, and wakes the refiller again
+        EXPECT_EQ(pool.map(sizes[0], rw), nullptr);
+        for(int i = 0; i < 1000; ++i)
+        {
+            pool.get_stats(stats);
+            if(stats.held == 2 * sizes[0])
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        EXPECT_EQ(stats.held, 2 * sizes[0]);
+        EXPECT_EQ(w.unmap_region(regions[2], sizes[0]), 0);
+        EXPECT_EQ(w.unmap_region(regions[3], sizes[0]), 0);
+    }
+
+    TEST_F(VmaTest, ThreadCacheReusesScrubbedExtent)
+    {
+        alloc::thread_cache cache(&v);
+        auto size = 4 * alloc::utils::min_alignment;
+
+        auto j = static_cast<char*>(alloc_pages(size));
+        ASSERT_NE(j, MAP_FAILED);
+        j[0] = 'x';
+        EXPECT_TRUE(cache.unmap(j, size));
+
+        // a request of a different size misses the cache
+        EXPECT_EQ(cache.map(size * 2, PROT_READ | PROT_WRITE), nullptr);
+
+        auto k = static_cast<char*>(cache.map(size, PROT_READ | PROT_WRITE));
+        EXPECT_EQ(k, j);
+        EXPECT_EQ(k[0], 0);
+        EXPECT_TRUE(cache.unmap(k, size));
+        cache.flush();
+        EXPECT_EQ(cache.map(size, PROT_READ | PROT_WRITE), nullptr);
+    }
+
+    TEST_F(VmaTest, ThreadCacheRejectsLargeExtents)
+    {
+        alloc::thread_cache cache(&v);
+        auto size = (alloc::thread_cache::max_pages + 1) * alloc::utils::min_alignment;
+
+        auto j = alloc_pages(size);
+        ASSERT_NE(j, MAP_FAILED);
+        EXPECT_FALSE(cache.unmap(j, size));
+        EXPECT_EQ(v.unmap_region(j, size), 0);
+    }
+
+    TEST_F(VmaTest, SafeAddressExcludesRegionEnd)
+    {
+        auto begin = reinterpret_cast<char*>(v.safe_begin());
+        auto end   = reinterpret_cast<char*>(v.safe_end());
+        EXPECT_TRUE(v.is_safe_addr(begin));
+        EXPECT_TRUE(v.is_safe_addr(end - 1));
+        EXPECT_FALSE(v.is_safe_addr(end));
+        EXPECT_FALSE(v.is_safe_addr(begin - 1));
+
+        EXPECT_TRUE(v.is_safe_range(begin, end - begin));
+        EXPECT_TRUE(v.is_safe_range(end - 1, 1));
+        EXPECT_FALSE(v.is_safe_range(end - 1, 2));
+        EXPECT_FALSE(v.is_safe_range(begin, 0));
+        EXPECT_FALSE(v.is_safe_range(begin + 1, SIZE_MAX));
+    }
+
+    TEST_F(VmaTest, ClassifyKernelsAgreeWithScalar)
+    {
+        auto begin = v.safe_begin();
+        auto end   = v.safe_end();
+        std::vector<const void*> ptrs;
+        auto middle = begin / 2 + end / 2;
+        for(auto p : {begin - 1, begin, begin + 1, end - 1, end, end + 1, uintptr_t(0), UINTPTR_MAX, middle})
+        {
+            ptrs.push_back(reinterpret_cast<const void*>(p));
+        }
+
+        // odd lengths exercise the tails of the vector loops
+        for(size_t n = 0; n <= 3 * ptrs.size(); ++n)
+        {
+            std::vector<const void*> in;
+            for(size_t i = 0; i < n; ++i)
+            {
+                in.push_back(ptrs[(i * 5) % ptrs.size()]);
+            }
+
+            std::vector<uint8_t> expected(n + 1, 0xff);
+            auto count = alloc::classify::pointers_scalar(begin, end, in.data(), n, expected.data());
+            EXPECT_EQ(expected[n], 0xff);
+
+            std::vector<uint8_t> out(n + 1, 0xff);
+            EXPECT_EQ(v.classify_pointers(in.data(), n, out.data()), count);
+            EXPECT_EQ(out, expected);
+
+            if(alloc::classify::has_avx2())
+            {
+                std::fill(out.begin(), out.end(), 0xff);
+                EXPECT_EQ(alloc::classify::pointers_avx2(begin, end, in.data(), n, out.data()), count);
+                EXPECT_EQ(out, expected);
+            }
+            if(alloc::classify::has_avx512())
+            {
+                std::fill(out.begin(), out.end(), 0xff);
+                EXPECT_EQ(alloc::classify::pointers_avx512(begin, end, in.data(), n, out.data()), count);
+                EXPECT_EQ(out, expected);
+            }
+        }
+    }
+
+    TEST_F(VmaTest, ReservationHonorsSizeAlignmentAndRights)
+    {
+        auto size      = 1UL << 30U;
+        auto alignment = 1UL << 36U;
+        alloc::vma w(1, size, alignment, PKEY_DISABLE_WRITE, -1);
+        EXPECT_EQ(w.safe_begin() % alignment, 0U);
+        EXPECT_EQ(w.safe_end() - w.safe_begin(), size);
+
+        auto key = w.get_pkey();
+        if(key != -1)
+        {
+            auto rights = alloc::pkru::read() & alloc::pkru::key_mask(key);
+            EXPECT_EQ(rights, alloc::pkru::key_rights(key, PKEY_DISABLE_WRITE));
+        }
+    }
+
+    TEST_F(VmaTest, NumaPlacementBindsEachShare)
+    {
+        auto size = 1UL << 30U;
+        alloc::vma w(2, size, 0, 0, -1, true);
+        alloc::node_stats stats[alloc::vma::max_nodes];
+        auto nodes = w.get_node_stats(stats, alloc::vma::max_nodes);
+        if(nodes == 0)
+        {
+            GTEST_SKIP() << "the kernel does not report NUMA nodes";
+        }
+        ASSERT_EQ(nodes, w.numa_nodes());
+
+        size_t reserved = 0;
+        for(size_t n = 0; n < nodes; ++n)
+        {
+            reserved += stats[n].reserved;
+        }
+        EXPECT_EQ(reserved, size);
+
+        // served from the first share, which the kernel only backs from its node, even once the pages are scrubbed
+        auto len  = 3 * alloc::utils::min_alignment;
+        auto addr = static_cast<char*>(w.map_region_on_node(stats[0].node, len, PROT_READ | PROT_WRITE));
+        ASSERT_NE(addr, MAP_FAILED);
+        EXPECT_GE(reinterpret_cast<uintptr_t>(addr), w.safe_begin());
+        EXPECT_LE(reinterpret_cast<uintptr_t>(addr + len), w.safe_begin() + stats[0].reserved);
+        addr[0] = 1;
+
+        w.get_node_stats(stats, alloc::vma::max_nodes);
+        EXPECT_EQ(stats[0].mapped, len);
+        EXPECT_EQ(w.unmap_region(addr, len), 0);
+        w.get_node_stats(stats, alloc::vma::max_nodes);
+        EXPECT_EQ(stats[0].mapped, 0U);
+
+        int mode           = -1;
+        unsigned long mask = 0;
+        ASSERT_EQ(syscall(SYS_get_mempolicy, &mode, &mask, alloc::vma::max_nodes, addr, MPOL_F_ADDR), 0);
+        EXPECT_EQ(mode, MPOL_BIND);
+        EXPECT_EQ(mask, 1UL << static_cast<unsigned int>(stats[0].node));
+
+        errno = 0;
+        EXPECT_EQ(w.map_region_on_node(-1, len, PROT_READ), MAP_FAILED);
+        EXPECT_EQ(errno, EINVAL);
+
+        // without NUMA placement there are no shares to choose from
+        alloc::vma flat(1, size);
+        EXPECT_EQ(flat.numa_nodes(), 1U);
+        EXPECT_EQ(flat.get_node_stats(stats, alloc::vma::max_nodes), 0U);
+        EXPECT_EQ(flat.map_region_on_node(stats[0].node, len, PROT_READ), MAP_FAILED);
+    }
+
+    TEST_F(VmaTest, MethodMapRegionPopulatesOnRequest)
+    {
+        alloc::vma w(1, 1UL << 30U);
+        auto page     = alloc::utils::min_alignment;
+        auto len      = 64 * page;
+        auto resident = [page, len](void* addr) {
+            unsigned char vec[64];
+            EXPECT_EQ(mincore(addr, len, vec), 0);
+            return std::count_if(vec, vec + len / page, [](unsigned char v) { return (v & 1U) != 0; });
+        };
+
+        auto flags  = alloc::utils::default_flags;
+        auto lazy   = w.map_region(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+        auto eager  = w.map_region(nullptr, len, PROT_READ | PROT_WRITE, flags | MAP_POPULATE, -1, 0);
+        auto hinted = w.aligned_map_region(len, page, PROT_READ | PROT_WRITE, alloc::vma::map_populate);
+        ASSERT_NE(lazy, MAP_FAILED);
+        ASSERT_NE(eager, MAP_FAILED);
+        ASSERT_NE(hinted, MAP_FAILED);
+        EXPECT_EQ(resident(lazy), 0);
+        EXPECT_EQ(resident(eager), 64);
+        EXPECT_EQ(resident(hinted), 64);
+
+        auto prot       = PROT_READ | PROT_WRITE;
+        auto background = w.map_region(nullptr, len, prot, flags | MAP_POPULATE | MAP_NONBLOCK, -1, 0);
+        ASSERT_NE(background, MAP_FAILED);
+        for(int i = 0; i < 1000 && resident(background) != 64; ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        EXPECT_EQ(resident(background), 64);
+
+        EXPECT_EQ(w.unmap_region(lazy, len), 0);
+        EXPECT_EQ(w.unmap_region(eager, len), 0);
+        EXPECT_EQ(w.unmap_region(hinted, len), 0);
+        EXPECT_EQ(w.unmap_region(background, len), 0);
+    }
+
+    TEST_F(VmaTest, MethodMapRegionSharesMemfdPages)
+    {
+        alloc::vma w(1, 1UL << 30U);
+        auto page = alloc::utils::min_alignment;
+        auto fd   = memfd_create("pkalloc_test", 0);
+        ASSERT_NE(fd, -1);
+        ASSERT_EQ(ftruncate(fd, 4 * page), 0);
+
+        // the same pages, seen through the reservation and through a plain mapping
+        auto shared = static_cast<char*>(w.map_region(nullptr, 4 * page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+        auto plain  = static_cast<char*>(mmap(nullptr, 4 * page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+        ASSERT_NE(shared, MAP_FAILED);
+        ASSERT_NE(plain, MAP_FAILED);
+        EXPECT_TRUE(w.is_safe_range(shared, 4 * page));
+        EXPECT_TRUE(w.is_backed(shared, 4 * page));
+        shared[3 * page] = 42;
+        EXPECT_EQ(plain[3 * page], 42);
+
+        // shrinking gives the tail back as reserved pages
+        ASSERT_EQ(w.remap_region(shared, 4 * page, 2 * page, 0), shared);
+        EXPECT_TRUE(w.is_backed(shared, 2 * page));
+        EXPECT_FALSE(w.is_backed(shared + 2 * page, 2 * page));
+
+        // growing would have to map more of the file, which cannot be done without unmapping the tail first
+        EXPECT_EQ(w.remap_region(shared, 2 * page, 3 * page, alloc::vma::remap_maymove), MAP_FAILED);
+        EXPECT_EQ(errno, EINVAL);
+
+        // even with purging deferred, unmapping puts fresh private pages back at once
+        w.set_purge_decay(std::chrono::milliseconds(1000));
+        shared[0] = 7;
+        ASSERT_EQ(w.unmap_region(shared, 2 * page), 0);
+        EXPECT_FALSE(w.is_backed(shared, 2 * page));
+        auto reused = static_cast<char*>(w.map_region(shared, 2 * page, PROT_READ | PROT_WRITE,
+                                                      alloc::utils::default_flags, alloc::utils::default_fd, 0));
+        ASSERT_EQ(reused, shared);
+        EXPECT_EQ(reused[0], 0);
+        reused[0] = 1;
+        EXPECT_EQ(plain[0], 7);
+        EXPECT_EQ(w.unmap_region(reused, 2 * page), 0);
+        w.set_purge_decay(std::chrono::milliseconds(0));
+
+        // a failed mapping leaves the reservation as it was
+        alloc::vma_stats before;
+        alloc::vma_stats after;
+        w.get_stats(before);
+        errno = 0;
+        EXPECT_EQ(w.map_region(nullptr, page, PROT_READ, MAP_SHARED, -2, 0), MAP_FAILED);
+        EXPECT_EQ(errno, EBADF);
+        w.get_stats(after);
+        EXPECT_EQ(after.free, before.free);
+
+        munmap(plain, 4 * page);
+        close(fd);
+    }
+
+    TEST_F(VmaTest, MethodMapRegionSharesAnonymousPagesWithChildren)
+    {
+        alloc::vma w(1, 1UL << 30U);
+        auto page = alloc::utils::min_alignment;
+
+        auto shared = static_cast<char*>(w.map_region(nullptr, 2 * page, PROT_READ | PROT_WRITE,
+                                                      MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+        ASSERT_NE(shared, MAP_FAILED);
+        EXPECT_TRUE(w.is_safe_range(shared, 2 * page));
+        EXPECT_TRUE(w.is_backed(shared, 2 * page));
+
+        auto child = fork();
+        ASSERT_NE(child, -1);
+        if(child == 0)
+        {
+            shared[page] = 42;
+            _exit(0);
+        }
+        int status = 0;
+        ASSERT_EQ(waitpid(child, &status, 0), child);
+        EXPECT_EQ(shared[page], 42);
+
+        EXPECT_EQ(w.unmap_region(shared, 2 * page), 0);
+        EXPECT_FALSE(w.is_backed(shared, 2 * page));
+    }
+
+    TEST_F(VmaTest, MethodMapRegionServesPrivatePagesWithoutAnFd)
+    {
+        alloc::vma w(1, 1UL << 30U);
+        auto page = alloc::utils::min_alignment;
+
+        // private mappings without a file are served from the reservation, whatever the other flags
+        auto region = static_cast<char*>(w.map_region(nullptr, 2 * page, PROT_READ | PROT_WRITE, 0, -1, 0));
+        ASSERT_NE(region, MAP_FAILED);
+        EXPECT_TRUE(w.is_safe_range(region, 2 * page));
+        EXPECT_FALSE(w.is_backed(region, 2 * page));
+        region[page] = 1;
+        EXPECT_EQ(w.unmap_region(region, 2 * page), 0);
+    }
+
 }        // namespace
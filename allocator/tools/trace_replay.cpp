@@ -0,0 +1,290 @@
+// trace_replay.cpp
+//
+// Copyright 2018 Paul Kirth
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+
+// Replays a trace recorded with pk_trace_start() or PKALLOC_TRACE against the freelist alone, on a simulated
+// address space: no pages are mapped and no syscalls are made while replaying, so the numbers reflect the freelist
+// and nothing else. Every map in the trace is placed by the freelist itself, so the simulated layout can differ
+// from the recorded one; unmaps are matched to maps by their recorded address.
+//
+//     trace_replay [--interval ops] [--size bytes] [--policy name] trace
+//
+// The trace is replayed once per placement policy, or only against the named one (see placement.hpp), whatever
+// PKALLOC_PLACEMENT the library was built with. Prints a CSV row every interval ops: the policy, the position in
+// the trace, the latency of the freelist calls in that interval, and the state of the free space afterwards. A
+// summary per policy is printed to stderr.
+
+#include "freelist.hpp"
+#include "placement.hpp"
+#include "trace.hpp"
+#include "utilities.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+    using clock = std::chrono::steady_clock;
+
+    struct mapping
+    {
+        char* addr;           // start in the simulated address space
+        size_t length;        // length rounded up to pages
+    };
+
+    bool load(const char* path, std::vector<alloc::trace::record>& records)
+    {
+        auto file = fopen(path, "rb");
+        if(!file)
+        {
+            perror(path);
+            return false;
+        }
+
+        alloc::trace::header h = {};
+        if(fread(&h, sizeof(h), 1, file) != 1 || memcmp(h.magic, alloc::trace::magic, sizeof(h.magic)) != 0 ||
+           h.version != alloc::trace::version || h.record_size != sizeof(alloc::trace::record))
+        {
+            fprintf(stderr, "%s: not a version %u trace\n", path, alloc::trace::version);
+            fclose(file);
+            return false;
+        }
+
+        alloc::trace::record r;
+        while(fread(&r, sizeof(r), 1, file) == 1)
+        {
+            records.push_back(r);
+        }
+        fclose(file);
+
+        // threads flush their buffers independently, so restore the order the calls were made in
+        std::stable_sort(records.begin(), records.end(),
+                         [](const alloc::trace::record& lhs, const alloc::trace::record& rhs) {
+                             return lhs.time_ns < rhs.time_ns;
+                         });
+        return true;
+    }
+
+    double percentile(std::vector<double>& samples, double q)
+    {
+        if(samples.empty())
+        {
+            return 0.0;
+        }
+        auto nth = samples.begin() + static_cast<ptrdiff_t>(q * static_cast<double>(samples.size() - 1));
+        std::nth_element(samples.begin(), nth, samples.end());
+        return *nth;
+    }
+
+    /**
+     * Replays the trace against a fresh freelist that places requests with Placement
+     * @param name the policy's name, printed with its results
+     * @param records the trace, in call order
+     * @param meta memory for the list nodes, utils::metadata_size bytes. Replays run one at a time and share it
+     * @param size size of the simulated address space
+     * @param interval number of freelist calls summarized by each CSV row
+     */
+    template <typename Placement>
+    void replay(const char* name, const std::vector<alloc::trace::record>& records, void* meta, size_t size,
+                size_t interval)
+    {
+        auto base = reinterpret_cast<char*>(alloc::utils::shard_granule);
+        alloc::basic_freelist<Placement> list;
+        list.init(meta, alloc::utils::metadata_size, base, base + size);
+
+        std::unordered_map<uint64_t, mapping> live;
+        live.reserve(records.size() / 2);
+        std::vector<double> latency;
+        latency.reserve(interval);
+        size_t failed    = 0;
+        size_t unmatched = 0;
+        double total_ns  = 0;
+        double frag      = 0;
+
+        for(size_t i = 0; i < records.size(); ++i)
+        {
+            auto& r = records[i];
+            if(r.op == alloc::trace::op_map)
+            {
+                auto start = clock::now();
+                auto addr  = static_cast<char*>(list.request(r.length));
+                auto end   = clock::now();
+                latency.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+
+                if(addr)
+                {
+                    auto length  = alloc::utils::get_aligned_size(r.length, alloc::utils::min_alignment);
+                    live[r.addr] = {addr, length};
+                }
+                else
+                {
+                    ++failed;
+                }
+            }
+            else if(r.op == alloc::trace::op_unmap)
+            {
+                // whole regions, or the front of one, as when a region is trimmed
+                auto it     = live.find(r.addr);
+                auto length = alloc::utils::get_aligned_size(r.length, alloc::utils::min_alignment);
+                if(it == live.end() || length > it->second.length)
+                {
+                    ++unmatched;
+                    continue;
+                }
+
+                auto m     = it->second;
+                auto start = clock::now();
+                list.return_region(m.addr, length);
+                auto end = clock::now();
+                latency.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+
+                live.erase(it);
+                if(length < m.length)
+                {
+                    live[r.addr + length] = {m.addr + length, m.length - length};
+                }
+            }
+
+            if(latency.size() == interval || (i + 1 == records.size() && !latency.empty()))
+            {
+                double sum = 0;
+                for(auto ns : latency)
+                {
+                    sum += ns;
+                }
+                total_ns += sum;
+
+                auto free_bytes = static_cast<size_t>(list.mem_available());
+                auto largest    = list.largest_extent();
+                auto max_ns     = *std::max_element(latency.begin(), latency.end());
+                auto mean_ns    = sum / static_cast<double>(latency.size());
+                auto p50        = percentile(latency, 0.50);
+                auto p99        = percentile(latency, 0.99);
+                frag = free_bytes ? 1.0 - static_cast<double>(largest) / static_cast<double>(free_bytes) : 0.0;
+                printf("%s,%zu,%.3f,%.1f,%.1f,%.1f,%.1f,%zu,%zu,%zu,%zu,%.6f\n", name, i + 1,
+                       static_cast<double>(r.time_ns) / 1e6, mean_ns, p50, p99, max_ns, live.size(),
+                       list.extent_count(), free_bytes, largest, frag);
+                latency.clear();
+            }
+        }
+
+        auto ops = records.size() - unmatched;
+        fprintf(stderr,
+                "[trace_replay]  %s: %zu ops in %.3f ms (%.2f Mops/s), %zu failed maps, %zu unmatched unmaps, "
+                "fragmentation %.6f\n",
+                name, ops, total_ns / 1e6, total_ns > 0 ? static_cast<double>(ops) / total_ns * 1e3 : 0.0, failed,
+                unmatched, frag);
+    }
+
+    struct policy
+    {
+        const char* name;
+        void (*replay)(const char*, const std::vector<alloc::trace::record>&, void*, size_t, size_t);
+    };
+
+    const policy policies[] = {
+      {"segregated_fit", replay<alloc::segregated_fit>},
+      {"first_fit", replay<alloc::first_fit>},
+      {"next_fit", replay<alloc::next_fit>},
+      {"best_fit", replay<alloc::best_fit>},
+      {"address_best_fit", replay<alloc::address_best_fit>},
+    };
+
+    void usage(const char* name)
+    {
+        fprintf(stderr, "usage: %s [--interval ops] [--size bytes] [--policy name] trace\npolicies:", name);
+        for(auto& p : policies)
+        {
+            fprintf(stderr, " %s", p.name);
+        }
+        fprintf(stderr, "\n");
+    }
+}        // namespace
+
+int main(int argc, char** argv)
+{
+    size_t interval    = 100000;
+    size_t size        = alloc::utils::default_size;
+    const char* path   = nullptr;
+    const char* chosen = nullptr;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+        {
+            interval = std::max(1UL, strtoul(argv[++i], nullptr, 0));
+        }
+        else if(strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            size = alloc::utils::get_aligned_size(strtoul(argv[++i], nullptr, 0), alloc::utils::min_alignment);
+        }
+        else if(strcmp(argv[i], "--policy") == 0 && i + 1 < argc)
+        {
+            chosen = argv[++i];
+        }
+        else if(!path && argv[i][0] != '-')
+        {
+            path = argv[i];
+        }
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    auto known = !chosen || std::any_of(std::begin(policies), std::end(policies),
+                                        [chosen](const policy& p) { return strcmp(p.name, chosen) == 0; });
+    if(!path || size == 0 || !known)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<alloc::trace::record> records;
+    if(!load(path, records))
+    {
+        return EXIT_FAILURE;
+    }
+
+    // only the list nodes need real memory; the region they describe is never touched, so it can start anywhere
+    auto meta = mmap(nullptr, alloc::utils::metadata_size, PROT_READ | PROT_WRITE, alloc::utils::default_flags, -1, 0);
+    if(meta == MAP_FAILED)
+    {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    printf("policy,ops,trace_ms,mean_ns,p50_ns,p99_ns,max_ns,live,extents,free_bytes,largest_free,fragmentation\n");
+    for(auto& p : policies)
+    {
+        if(!chosen || strcmp(p.name, chosen) == 0)
+        {
+            p.replay(p.name, records, meta, size, interval);
+        }
+    }
+    return EXIT_SUCCESS;
+}